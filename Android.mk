@@ -27,7 +27,15 @@ ifeq ($(strip $(BOARD_ALSA_AUDIO)),tiny)
 	LOCAL_MODULE := audio.primary.amlogic
 	LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 	LOCAL_SRC_FILES := \
-		audio_hw.c
+		audio_hw.c \
+		audio_echo_ref.c \
+		audio_mix.c \
+		audio_mmap.c \
+		audio_props.c \
+		audio_ring.c \
+		audio_timestamp.c \
+		audio_topology.c \
+		audio_volume.c
 	LOCAL_C_INCLUDES += \
 		external/tinyalsa/include \
 		system/media/audio_utils/include \
@@ -37,6 +45,10 @@ ifeq ($(strip $(BOARD_ALSA_AUDIO)),tiny)
 		liblog libcutils libtinyalsa \
 		libaudioutils libdl libaudioroute
 	LOCAL_MODULE_TAGS := optional
+	# NEON software mixer and volume
+	ifeq ($(ARCH_ARM_HAVE_NEON),true)
+		LOCAL_ARM_NEON := true
+	endif
 
 	include $(BUILD_SHARED_LIBRARY)
 #build for USB audio
@@ -47,14 +59,34 @@ ifeq ($(strip $(BOARD_ALSA_AUDIO)),tiny)
 		LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 		LOCAL_SRC_FILES := \
 			usb_audio_hw.c \
-			audio_resampler.c
+			audio_resampler.c \
+			audio_timestamp.c \
+			audio_topology.c \
+			audio_volume.c
 		LOCAL_C_INCLUDES += \
 			external/tinyalsa/include \
 			system/media/audio_utils/include 
 		LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils
 		LOCAL_MODULE_TAGS := optional
+		# NEON resampler kernels, still picked at runtime from /proc/cpuinfo
+		ifeq ($(ARCH_ARM_HAVE_NEON),true)
+			LOCAL_ARM_NEON := true
+		endif
 		
 		include $(BUILD_SHARED_LIBRARY)
+
+		# resampler throughput and quality report, runs on the build host
+		include $(CLEAR_VARS)
+
+		LOCAL_MODULE := audio_resampler_bench
+		LOCAL_SRC_FILES := \
+			audio_resampler_bench.c \
+			audio_resampler.c
+		LOCAL_CFLAGS := -DRESAMPLER_HOST_BUILD
+		LOCAL_LDLIBS := -lm -lpthread
+		LOCAL_MODULE_TAGS := optional
+
+		include $(BUILD_HOST_EXECUTABLE)
 	endif
 #build for hdmi audio HAL
 		include $(CLEAR_VARS)
@@ -62,7 +94,12 @@ ifeq ($(strip $(BOARD_ALSA_AUDIO)),tiny)
 		LOCAL_MODULE := audio.hdmi.amlogic
 		LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 		LOCAL_SRC_FILES := \
-			hdmi_audio_hw.c
+			hdmi_audio_hw.c \
+			audio_mmap.c \
+			audio_props.c \
+			audio_timestamp.c \
+			audio_topology.c \
+			audio_volume.c
 		LOCAL_C_INCLUDES += \
 			external/tinyalsa/include \
 			system/media/audio_effects/include \
@@ -70,6 +107,10 @@ ifeq ($(strip $(BOARD_ALSA_AUDIO)),tiny)
 			
 		LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils
 		LOCAL_MODULE_TAGS := optional
+		# NEON volume and 8ch widening
+		ifeq ($(ARCH_ARM_HAVE_NEON),true)
+			LOCAL_ARM_NEON := true
+		endif
 		
 		include $(BUILD_SHARED_LIBRARY)
 
@@ -0,0 +1,293 @@
+#define LOG_TAG "audio_echo_ref"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "audio_echo_ref.h"
+
+#define NSEC_PER_SEC 1000000000LL
+/* source frames converted per refill of ref->buffer */
+#define ECHO_REF_FILL_FRAMES 256
+/* the most channels a writer may hand in */
+#define ECHO_REF_MAX_CHANNELS 8
+/* jitter of the stamps that is followed rather than corrected */
+#define ECHO_REF_TOLERANCE_NS 2000000LL
+
+struct echo_ref_chunk {
+    int64_t time_us;
+    uint32_t frames;
+    uint32_t rate;
+    uint32_t channels;
+    uint32_t reserved;
+};
+
+static int64_t frames_to_ns(size_t frames, unsigned int rate)
+{
+    return (int64_t)frames * NSEC_PER_SEC / rate;
+}
+
+/* load the next chunk header, returns false if the writer has not got that far */
+static bool echo_ref_next_chunk(struct audio_echo_ref *ref)
+{
+    struct echo_ref_chunk chunk;
+
+    if (ref->src_left != 0)
+        return true;
+    if (audio_ring_used(&ref->ring) < sizeof(chunk))
+        return false;
+    audio_ring_read(&ref->ring, &chunk, sizeof(chunk));
+    ref->src_rate = chunk.rate;
+    ref->src_channels = chunk.channels;
+    ref->src_left = chunk.frames;
+    ref->src_ns = chunk.time_us * 1000;
+    return true;
+}
+
+/* read up to frames of the current chunk into ref->scratch */
+static size_t echo_ref_take(struct audio_echo_ref *ref, size_t frames)
+{
+    size_t frame_size = ref->src_channels * sizeof(int16_t);
+    size_t avail = audio_ring_used(&ref->ring) / frame_size;
+
+    if (frames > ref->src_left)
+        frames = ref->src_left;
+    if (frames > avail)
+        frames = avail;
+    if (frames > ECHO_REF_FILL_FRAMES)
+        frames = ECHO_REF_FILL_FRAMES;
+    audio_ring_read(&ref->ring, ref->scratch, frames * frame_size);
+    ref->src_left -= frames;
+    ref->src_ns += frames_to_ns(frames, ref->src_rate);
+    return frames;
+}
+
+static void echo_ref_convert(int16_t *dst, unsigned int dst_channels,
+        const int16_t *src, unsigned int src_channels, size_t frames)
+{
+    size_t i;
+    unsigned int c;
+    int32_t sum;
+
+    if (dst_channels == src_channels) {
+        memcpy(dst, src, frames * src_channels * sizeof(int16_t));
+        return;
+    }
+    for (i = 0; i < frames; i++) {
+        if (dst_channels == 1) {
+            for (c = 0, sum = 0; c < src_channels; c++)
+                sum += src[c];
+            dst[0] = sum / (int32_t)src_channels;
+        } else {
+            for (c = 0; c < dst_channels; c++)
+                dst[c] = src[c < src_channels ? c : src_channels - 1];
+        }
+        dst += dst_channels;
+        src += src_channels;
+    }
+}
+
+/*
+ * Refill ref->buffer with what was played from ref->next_ns on: frames
+ * stamped too early are dropped, a gap in the stamps and anything the
+ * writer has not handed in yet become silence.
+ */
+static void echo_ref_fill(struct audio_echo_ref *ref)
+{
+    unsigned int rate = ref->conv_rate;
+    size_t frames = 0;
+    size_t n;
+    int64_t gap;
+
+    while (frames < ECHO_REF_FILL_FRAMES) {
+        if (!echo_ref_next_chunk(ref) || ref->src_rate != rate)
+            break;
+        gap = ref->src_ns - ref->next_ns;
+        /* jitter is followed, but a real gap or overlap is closed all the way */
+        if (gap > ECHO_REF_TOLERANCE_NS || gap < -ECHO_REF_TOLERANCE_NS)
+            ref->realign = true;
+        if (ref->realign) {
+            n = (size_t)(((gap < 0 ? -gap : gap) * rate + NSEC_PER_SEC / 2) / NSEC_PER_SEC);
+            if (n == 0) {
+                ref->realign = false;
+            } else if (gap < 0) {
+                if (echo_ref_take(ref, n) == 0)
+                    break;
+                continue;
+            }
+        }
+        if (ref->realign) {
+            if (n > ECHO_REF_FILL_FRAMES - frames)
+                n = ECHO_REF_FILL_FRAMES - frames;
+            memset(ref->buffer + frames * ref->channels, 0,
+                   n * ref->channels * sizeof(int16_t));
+        } else {
+            n = echo_ref_take(ref, ECHO_REF_FILL_FRAMES - frames);
+            if (n == 0)
+                break;
+            echo_ref_convert(ref->buffer + frames * ref->channels, ref->channels,
+                             ref->scratch, ref->src_channels, n);
+        }
+        frames += n;
+        ref->next_ns += frames_to_ns(n, rate);
+    }
+    if (frames < ECHO_REF_FILL_FRAMES) {
+        n = ECHO_REF_FILL_FRAMES - frames;
+        memset(ref->buffer + frames * ref->channels, 0, n * ref->channels * sizeof(int16_t));
+        ref->next_ns += frames_to_ns(n, rate);
+    }
+    ref->buffer_pos = 0;
+    ref->buffer_frames = ECHO_REF_FILL_FRAMES;
+}
+
+static int echo_ref_get_next_buffer(struct resampler_buffer_provider *provider,
+                                    struct resampler_buffer *buffer)
+{
+    struct audio_echo_ref *ref = (struct audio_echo_ref *)((char *)provider -
+                                   offsetof(struct audio_echo_ref, provider));
+
+    if (ref->buffer_pos == ref->buffer_frames)
+        echo_ref_fill(ref);
+    if (buffer->frame_count > ref->buffer_frames - ref->buffer_pos)
+        buffer->frame_count = ref->buffer_frames - ref->buffer_pos;
+    buffer->i16 = ref->buffer + ref->buffer_pos * ref->channels;
+    return 0;
+}
+
+static void echo_ref_release_buffer(struct resampler_buffer_provider *provider,
+                                    struct resampler_buffer *buffer)
+{
+    struct audio_echo_ref *ref = (struct audio_echo_ref *)((char *)provider -
+                                   offsetof(struct audio_echo_ref, provider));
+
+    ref->buffer_pos += buffer->frame_count;
+}
+
+/* follow the rate of the writer, which changes with the output config */
+static int echo_ref_set_rate(struct audio_echo_ref *ref, unsigned int rate)
+{
+    int ret;
+
+    if (ref->resampler != NULL) {
+        release_resampler(ref->resampler);
+        ref->resampler = NULL;
+    }
+    ref->conv_rate = rate;
+    ref->buffer_pos = ref->buffer_frames = 0;
+    ref->aligned = false;
+    ref->realign = false;
+    if (rate == ref->rate)
+        return 0;
+    ret = create_resampler(rate, ref->rate, ref->channels, RESAMPLER_QUALITY_DEFAULT,
+                           &ref->provider, &ref->resampler);
+    if (ret != 0) {
+        ALOGE("cannot resample the echo reference from %u to %u Hz", rate, ref->rate);
+        ref->resampler = NULL;
+        ref->conv_rate = 0;
+    }
+    return ret;
+}
+
+struct audio_echo_ref *audio_echo_ref_create(unsigned int rate, unsigned int channels,
+        size_t bytes)
+{
+    struct audio_echo_ref *ref = calloc(1, sizeof(*ref));
+
+    if (ref == NULL)
+        return NULL;
+    ref->rate = rate;
+    ref->channels = channels;
+    ref->provider.get_next_buffer = echo_ref_get_next_buffer;
+    ref->provider.release_buffer = echo_ref_release_buffer;
+    ref->buffer = malloc(ECHO_REF_FILL_FRAMES * channels * sizeof(int16_t));
+    ref->scratch = malloc(ECHO_REF_FILL_FRAMES * ECHO_REF_MAX_CHANNELS * sizeof(int16_t));
+    if (ref->buffer == NULL || ref->scratch == NULL ||
+            audio_ring_init(&ref->ring, bytes) != 0) {
+        audio_echo_ref_destroy(ref);
+        return NULL;
+    }
+    return ref;
+}
+
+void audio_echo_ref_destroy(struct audio_echo_ref *ref)
+{
+    if (ref->resampler != NULL)
+        release_resampler(ref->resampler);
+    audio_ring_release(&ref->ring);
+    free(ref->buffer);
+    free(ref->scratch);
+    free(ref);
+}
+
+int audio_echo_ref_write(struct audio_echo_ref *ref, const int16_t *data, size_t frames,
+        unsigned int rate, unsigned int channels, int64_t time_us)
+{
+    struct echo_ref_chunk chunk;
+    size_t bytes = frames * channels * sizeof(int16_t);
+
+    if (frames == 0)
+        return 0;
+    if (channels > ECHO_REF_MAX_CHANNELS ||
+            audio_ring_space(&ref->ring) < sizeof(chunk) + bytes)
+        return -EAGAIN;
+    chunk.time_us = time_us;
+    chunk.frames = frames;
+    chunk.rate = rate;
+    chunk.channels = channels;
+    chunk.reserved = 0;
+    /* the reader copes with a header whose frames are still on their way */
+    audio_ring_write(&ref->ring, &chunk, sizeof(chunk));
+    audio_ring_write(&ref->ring, data, bytes);
+    return 0;
+}
+
+void audio_echo_ref_read(struct audio_echo_ref *ref, int16_t *data, size_t frames,
+        int64_t time_us, int32_t *offset_us)
+{
+    int64_t want_ns = time_us * 1000;
+    int64_t error;
+    size_t done, n;
+    struct resampler_buffer buffer;
+
+    *offset_us = 0;
+    if (echo_ref_next_chunk(ref) && ref->src_rate != ref->conv_rate)
+        echo_ref_set_rate(ref, ref->src_rate);
+    if (ref->conv_rate == 0) {
+        /* nothing played yet */
+        memset(data, 0, frames * ref->channels * sizeof(int16_t));
+        return;
+    }
+
+    /* the resampler output lags what it was fed by its own delay */
+    if (ref->resampler != NULL)
+        want_ns += ref->resampler->delay_ns(ref->resampler);
+    error = ref->next_ns - frames_to_ns(ref->buffer_frames - ref->buffer_pos, ref->conv_rate) -
+            want_ns;
+    if (!ref->aligned || error > ECHO_REF_TOLERANCE_NS || error < -ECHO_REF_TOLERANCE_NS) {
+        ref->buffer_pos = ref->buffer_frames = 0;
+        if (ref->resampler != NULL)
+            ref->resampler->reset(ref->resampler);
+        /* the resampler has to be fed its delay ahead of the capture time */
+        ref->next_ns = want_ns;
+        ref->aligned = true;
+        ref->realign = false;
+        error = 0;
+    }
+    *offset_us = (int32_t)(error / 1000);
+
+    if (ref->resampler != NULL) {
+        ref->resampler->resample_from_provider(ref->resampler, data, &frames);
+        return;
+    }
+    for (done = 0; done < frames; done += n) {
+        buffer.frame_count = frames - done;
+        echo_ref_get_next_buffer(&ref->provider, &buffer);
+        n = buffer.frame_count;
+        memcpy(data + done * ref->channels, buffer.i16, n * ref->channels * sizeof(int16_t));
+        echo_ref_release_buffer(&ref->provider, &buffer);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef __AUDIO_ECHO_REF_H__
+#define __AUDIO_ECHO_REF_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <audio_utils/resampler.h>
+
+#include "audio_ring.h"
+
+/*
+ * Echo reference kept inside the HAL: the frames an output hands to its
+ * pcm, in chunks stamped with the CLOCK_MONOTONIC time at which their first
+ * frame is played. One output thread writes and one capture thread reads,
+ * without locks. The reader asks for the frames played over a window of
+ * time, in its own rate and channel count, so the echo canceller gets its
+ * reference already aligned with the capture.
+ */
+struct audio_echo_ref {
+    struct audio_ring ring;     /* chunk headers, each followed by its frames */
+    /* reader side only */
+    unsigned int rate;
+    unsigned int channels;
+    unsigned int src_rate;      /* of the chunk being read */
+    unsigned int src_channels;
+    size_t src_left;            /* frames of that chunk still in the ring */
+    int64_t src_ns;             /* play time of its next frame */
+    bool realign;               /* closing a gap or an overlap in the stamps */
+    unsigned int conv_rate;     /* what the resampler was created for */
+    bool aligned;
+    int64_t next_ns;            /* play time of the frame after ref->buffer */
+    struct resampler_itfe *resampler;
+    struct resampler_buffer_provider provider;
+    int16_t *buffer;            /* source frames in the reader's channel count */
+    size_t buffer_pos;
+    size_t buffer_frames;
+    int16_t *scratch;           /* source frames as they sit in the ring */
+};
+
+/* bytes of ring, for the reader's rate and channels; NULL on failure */
+struct audio_echo_ref *audio_echo_ref_create(unsigned int rate, unsigned int channels,
+        size_t bytes);
+void audio_echo_ref_destroy(struct audio_echo_ref *ref);
+
+/*
+ * Writer side: frames of the given rate and channel count, the first of
+ * which is played at time_us. A chunk that does not fit is dropped and the
+ * reader plays silence in its place. Returns 0 or -EAGAIN.
+ */
+int audio_echo_ref_write(struct audio_echo_ref *ref, const int16_t *data, size_t frames,
+        unsigned int rate, unsigned int channels, int64_t time_us);
+
+/*
+ * Reader side: fills frames, in the reader's rate and channel count, with
+ * what was played from time_us on; silence wherever nothing was. offset_us
+ * is what is left of the misalignment, within the tolerance of the reader.
+ */
+void audio_echo_ref_read(struct audio_echo_ref *ref, int16_t *data, size_t frames,
+        int64_t time_us, int32_t *offset_us);
+
+#endif
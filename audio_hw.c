@@ -27,10 +27,15 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
 
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
 #include <cutils/properties.h>
@@ -41,10 +46,18 @@
 
 #include <tinyalsa/asoundlib.h>
 #include <audio_utils/resampler.h>
-#include <audio_utils/echo_reference.h>
 #include <hardware/audio_effect.h>
 #include <audio_effects/effect_aec.h>
 #include <audio_route/audio_route.h>
+
+#include "audio_echo_ref.h"
+#include "audio_mix.h"
+#include "audio_mmap.h"
+#include "audio_props.h"
+#include "audio_ring.h"
+#include "audio_timestamp.h"
+#include "audio_topology.h"
+#include "audio_volume.h"
 /* ALSA cards for AML */
 #define CARD_AMLOGIC_BOARD 0 
 #define CARD_AMLOGIC_USB 1
@@ -58,6 +71,16 @@ static unsigned  PERIOD_SIZE  = DEFAULT_PERIOD_SIZE;
 static unsigned  CAPTURE_PERIOD_SIZE = DEFAULT_CAPTURE_PERIOD_SIZE;
 /* number of periods for low power playback */
 #define PLAYBACK_PERIOD_COUNT 4
+/* low latency playback for AUDIO_OUTPUT_FLAG_FAST, about 5 ms at 48 kHz */
+#define FAST_PERIOD_SIZE 128
+#define FAST_PERIOD_COUNT 2
+/* AUDIO_OUTPUT_FLAG_DEEP_BUFFER, always played as in low power */
+#define DEEP_PERIOD_SIZE 4096
+#define DEEP_PERIOD_COUNT 4
+/* buffer of normal streams, so that screen-off playback can run deep */
+#define LOW_POWER_PERIOD_COUNT 16
+/* the same buffer cut in fewer, larger periods while in low power */
+#define LOW_POWER_LARGE_PERIOD_COUNT 4
 /* number of periods for capture */
 #define CAPTURE_PERIOD_COUNT 4
 
@@ -77,6 +100,24 @@ static unsigned int  DEFAULT_OUT_SAMPLING_RATE  = 48000;
 #define VX_NB_SAMPLING_RATE 8000
 #define MIXER_XML_PATH "/system/etc/mixer_paths.xml"
 
+/* out_write() only fills a ring that a writer thread drains into the pcm */
+#define WRITER_THREAD_PROPERTY "media.audio.writer_thread"
+/* ring size, in periods of pcm_config_out */
+#define WRITER_RING_PERIODS 2
+#define WRITER_THREAD_PRIORITY 2
+/* open the pcm with PCM_MMAP | PCM_NOIRQ and write into the DMA buffer */
+#define MMAP_PLAYBACK_PROPERTY "media.audio.mmap_playback"
+/* keep the pcm open but stopped this long after standby, 0 closes it at once */
+#define STANDBY_DELAY_PROPERTY "media.audio.standby_delay_ms"
+/* every output stream feeds a ring, one mixer thread sums them into the pcm */
+#define HAL_MIXER_PROPERTY "media.audio.hal_mixer"
+#define MIXER_MAX_TRACKS 8
+/* a period the pcm keeps refusing is dropped after this many tries */
+#define MIXER_MAX_RETRIES 4
+/* what the output played is kept this long for the echo canceller, at
+ * the full power rate and in stereo */
+#define ECHO_REFERENCE_MS 500
+
 struct pcm_config pcm_config_out = {
     .channels = 2,
     .rate = MM_FULL_POWER_SAMPLING_RATE,
@@ -85,6 +126,25 @@ struct pcm_config pcm_config_out = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+struct pcm_config pcm_config_out_fast = {
+    .channels = 2,
+    .rate = MM_FULL_POWER_SAMPLING_RATE,
+    .period_size = FAST_PERIOD_SIZE,
+    .period_count = FAST_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    /* start as soon as one period is queued */
+    .start_threshold = FAST_PERIOD_SIZE,
+};
+
+struct pcm_config pcm_config_out_deep = {
+    .channels = 2,
+    .rate = MM_FULL_POWER_SAMPLING_RATE,
+    .period_size = DEEP_PERIOD_SIZE,
+    .period_count = DEEP_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = DEEP_PERIOD_SIZE * 2,
+};
+
 struct pcm_config pcm_config_in = {
     .channels = 2,
     .rate = MM_FULL_POWER_SAMPLING_RATE,
@@ -101,6 +161,22 @@ struct pcm_config pcm_config_bt = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+struct aml_mixer {
+    bool enabled;
+    pthread_mutex_t lock;       /* guards tracks[], taken after out->lock */
+    struct aml_stream_out *tracks[MIXER_MAX_TRACKS];
+    int track_count;
+    struct pcm_config config;
+    struct pcm *pcm;
+    struct audio_mmap mmap;
+    int16_t *mix_buffer;        /* one period each, owned by the mixer thread */
+    int16_t *track_buffer;
+    pthread_t thread;
+    bool running;
+    volatile int32_t exit;
+    struct audio_echo_ref *echo_reference;  /* fed by the mixer thread */
+};
+
 struct aml_audio_device {
     struct audio_hw_device hw_device;
 
@@ -115,8 +191,10 @@ struct aml_audio_device {
     bool mic_mute;
     unsigned int card;
     struct audio_route *ar;
-    struct echo_reference_itfe *echo_reference;
+    struct audio_echo_ref *echo_reference;
     bool low_power;
+    struct aml_mixer mixer;     /* see HAL_MIXER_PROPERTY */
+    volatile int32_t device_seq;    /* bumped by adev_device_changed() */
 };
 
 struct aml_stream_out {
@@ -128,11 +206,40 @@ struct aml_stream_out {
     char *buffer;
     size_t buffer_frames;
     bool standby;
-    struct echo_reference_itfe *echo_reference;
+    struct audio_echo_ref *echo_reference;  /* fed by out_write() */
     struct aml_audio_device *dev;
     int write_threshold;
+    audio_output_flags_t flags;
+    bool low_power_ok;          /* the pcm has room for low power thresholds */
     bool low_power;
-    uint32_t frame_count;
+    volatile int32_t frame_count;   /* also advanced by the writer or mixer thread */
+    uint64_t frames_written;    /* stream frames, kept across standby */
+    struct audio_render_clock render_clock;
+    /* writer thread mode, see WRITER_THREAD_PROPERTY */
+    struct audio_ring ring;
+    sem_t ring_data;            /* posted by out_write() after filling */
+    sem_t ring_space;           /* posted by the writer after draining */
+    pthread_t writer;
+    char *writer_buffer;        /* one period, owned by the writer thread */
+    bool writer_running;
+    volatile int32_t writer_exit;
+    struct audio_mmap mmap;
+    bool mixed;                 /* a track of dev->mixer, out->pcm stays NULL */
+    struct audio_volume volume;
+    int16_t *volume_buf;        /* the scaled write, the caller's buffer is const */
+    size_t volume_buf_size;     /* in bytes */
+    /* deferred standby, see STANDBY_DELAY_PROPERTY */
+    unsigned int standby_delay_ms;
+    bool standby_pending;       /* pcm stopped but open until standby_deadline */
+    struct timespec standby_deadline;
+    pthread_mutex_t standby_lock;   /* guards the three fields below */
+    pthread_cond_t standby_cond;
+    bool standby_armed;
+    bool standby_exit;
+    pthread_t standby_thread;
+    uint32_t warm_starts;
+    uint32_t cold_starts;
+    int32_t device_seq;         /* dev->device_seq last seen by out_write() */
 };
 
 #define MAX_PREPROCESSORS 3 /* maximum one AGC + one NS + one AEC per input stream */
@@ -149,7 +256,7 @@ struct aml_stream_in {
     unsigned int requested_rate;
     bool standby;
     int source;
-    struct echo_reference_itfe *echo_reference;
+    struct audio_echo_ref *echo_reference;
     bool need_echo_reference;
     effect_handle_t preprocessors[MAX_PREPROCESSORS];
     int num_preprocessors;
@@ -174,6 +281,12 @@ static void select_devices(struct aml_audio_device *adev);
 static int adev_set_voice_volume(struct audio_hw_device *dev, float volume);
 static int do_input_standby(struct aml_stream_in *in);
 static int do_output_standby(struct aml_stream_out *out);
+static void out_wait_threshold(struct aml_stream_out *out);
+static void remove_echo_reference(struct aml_stream_out *out,
+                                  struct audio_echo_ref *reference);
+static void echo_reference_write(struct audio_echo_ref *reference, struct pcm *pcm,
+                                 const struct pcm_config *config, const int16_t *data,
+                                 size_t frames, size_t ahead);
 static uint32_t out_get_sample_rate(const struct audio_stream *stream);
 
 static int getprop_bool(const char * path)
@@ -188,6 +301,15 @@ static int getprop_bool(const char * path)
     }
     return 0;
 }
+
+/* makes the next out_write() of every stream take the hw device mutex and
+ * re-evaluate its device dependent state, called with adev->lock held
+ */
+static void adev_device_changed(struct aml_audio_device *adev)
+{
+    android_atomic_inc(&adev->device_seq);
+}
+
 static void select_devices(struct aml_audio_device *adev)
 {
     LOGFUNC("%s(mode=%d, out_device=%#x)", __FUNCTION__, adev->mode, adev->out_device);
@@ -364,158 +486,233 @@ int get_external_card(int type)
 }
 #endif
 
+/* card and port lookups go through the index built at adev_open() */
 static int get_aml_card(){
-    int card = -1, err = 0;
-    int fd = -1;
-    unsigned fileSize = 512;
-    char *read_buf = NULL, *pd = NULL;
-    static const char *const SOUND_CARDS_PATH = "/proc/asound/cards";
-    fd = open(SOUND_CARDS_PATH, O_RDONLY);
-    if (fd < 0) {
-        ALOGE("ERROR: failed to open config file %s error: %d\n", SOUND_CARDS_PATH, errno);
-        close(fd);
-        return -EINVAL;
-    }
-
-    read_buf = (char *)malloc(fileSize);
-    if (!read_buf) {
-        ALOGE("Failed to malloc read_buf");
-        close(fd);
-        return -ENOMEM;
-    }
-    memset(read_buf, 0x0, fileSize);
-    err = read(fd, read_buf, fileSize);
-    if (fd < 0) {
-        ALOGE("ERROR: failed to read config file %s error: %d\n", SOUND_CARDS_PATH, errno);
-        close(fd);
-        return -EINVAL;
-    }
-    pd = strstr(read_buf, "AML");
-    card = *(pd - 3) - '0';
-
-OUT:
-    free(read_buf);
-    close(fd);
-    return card;
-}
-
-static int get_pcm_bt_port(){
-    int port = -1, err = 0;
-    int fd = -1;
-    unsigned fileSize = 512;
-    char *read_buf = NULL, *pd = NULL;
-    static const char *const SOUND_PCM_PATH = "/proc/asound/pcm";
-    fd = open(SOUND_PCM_PATH, O_RDONLY);
-    if (fd < 0) {
-        ALOGE("ERROR: failed to open config file %s error: %d\n", SOUND_PCM_PATH, errno);
-        close(fd);
-        return -EINVAL;
-    }
+    return audio_topology_find_card("AML");
+}
 
-    read_buf = (char *)malloc(fileSize);
-    if (!read_buf) {
-        ALOGE("Failed to malloc read_buf");
-        close(fd);
-        return -ENOMEM;
-    }
-    memset(read_buf, 0x0, fileSize);
-    err = read(fd, read_buf, fileSize);
-    if (fd < 0) {
-        ALOGE("ERROR: failed to read config file %s error: %d\n", SOUND_PCM_PATH, errno);
-        close(fd);
-        return -EINVAL;
-    }
-    pd = strstr(read_buf, "pcm2bt-pcm");
-    port = *(pd + 11) - '0';
+static int get_pcm_bt_port(int card, bool capture){
+    return audio_topology_find_pcm(card, "pcm2bt-pcm", capture);
+}
 
-OUT:
-    free(read_buf);
-    close(fd);
-    return port;
+static int get_spdif_port(int card, bool capture){
+    return audio_topology_find_pcm(card, "SPDIF", capture);
 }
 
-static int get_spdif_port(){
-    int port = -1, err = 0;
-    int fd = -1;
-    unsigned fileSize = 512;
-    char *read_buf = NULL, *pd = NULL;
-    static const char *const SOUND_PCM_PATH = "/proc/asound/pcm";
-    fd = open(SOUND_PCM_PATH, O_RDONLY);
-    if (fd < 0) {
-        ALOGE("ERROR: failed to open config file %s error: %d\n", SOUND_PCM_PATH, errno);
-        close(fd);
-        return -EINVAL;
+static void *out_writer_thread(void *context)
+{
+    struct aml_stream_out *out = (struct aml_stream_out *)context;
+    size_t period = pcm_frames_to_bytes(out->pcm, out->config.period_size);
+    size_t frame_size = pcm_frames_to_bytes(out->pcm, 1);
+    struct sched_param param;
+    size_t bytes;
+    int ret;
+
+    param.sched_priority = WRITER_THREAD_PRIORITY;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+        ALOGW("writer thread cannot get SCHED_FIFO, staying at normal priority");
+
+    while (!android_atomic_acquire_load(&out->writer_exit)) {
+        bytes = audio_ring_read(&out->ring, out->writer_buffer, period);
+        if (bytes == 0) {
+            sem_wait(&out->ring_data);
+            continue;
+        }
+        if (out->mmap.pcm != NULL) {
+            ret = audio_mmap_copy(&out->mmap, out->writer_buffer, bytes / frame_size);
+        } else {
+            out_wait_threshold(out);
+            ret = pcm_write(out->pcm, out->writer_buffer, bytes);
+        }
+        if (ret != 0)
+            ALOGV("writer thread: write error %s", pcm_get_error(out->pcm));
+        android_atomic_add(bytes / frame_size, &out->frame_count);
+        sem_post(&out->ring_space);
     }
+    return NULL;
+}
 
-    read_buf = (char *)malloc(fileSize);
-    if (!read_buf) {
-        ALOGE("Failed to malloc read_buf");
-        close(fd);
+/* must be called with the output stream mutex locked, after the pcm is open */
+static int out_writer_start(struct aml_stream_out *out)
+{
+    out->writer_buffer = malloc(pcm_frames_to_bytes(out->pcm, out->config.period_size));
+    if (out->writer_buffer == NULL)
+        return -ENOMEM;
+    out->writer_exit = 0;
+    if (pthread_create(&out->writer, NULL, out_writer_thread, out) != 0) {
+        free(out->writer_buffer);
+        out->writer_buffer = NULL;
         return -ENOMEM;
     }
-    memset(read_buf, 0x0, fileSize);
-    err = read(fd, read_buf, fileSize);
-    if (fd < 0) {
-        ALOGE("ERROR: failed to read config file %s error: %d\n", SOUND_PCM_PATH, errno);
-        close(fd);
-        return -EINVAL;
-    }
-    pd = strstr(read_buf, "SPDIF");
-    port = *(pd -3) - '0';
+    out->writer_running = true;
+    return 0;
+}
 
-OUT:
-    free(read_buf);
-    close(fd);
-    return port;
+/* drop whatever is still queued, once nothing drains the ring any more */
+static void out_ring_flush(struct aml_stream_out *out)
+{
+    audio_ring_reset(&out->ring);
+    while (sem_trywait(&out->ring_data) == 0)
+        ;
+    while (sem_trywait(&out->ring_space) == 0)
+        ;
 }
-/* must be called with hw device and output stream mutexes locked */
-static int start_output_stream(struct aml_stream_out *out)
+
+/* must be called with the output stream mutex locked, before the pcm is closed */
+static void out_writer_stop(struct aml_stream_out *out)
 {
-    struct aml_audio_device *adev = out->dev;
-    unsigned int card = CARD_AMLOGIC_DEFAULT;
-    unsigned int port = PORT_MM;
-    int ret;
+    if (!out->writer_running)
+        return;
 
-    LOGFUNC("%s(adev->out_device=%#x, adev->mode=%d)", __FUNCTION__, adev->out_device, adev->mode);
+    android_atomic_release_store(1, &out->writer_exit);
+    sem_post(&out->ring_data);
+    pthread_join(out->writer, NULL);
+    out->writer_running = false;
+    free(out->writer_buffer);
+    out->writer_buffer = NULL;
+
+    /* whatever was still queued is dropped with the pcm */
+    out_ring_flush(out);
+}
+
+/* queue frames for the writer thread, waiting for it while the ring is full */
+static int out_writer_queue(struct aml_stream_out *out, const void *data, size_t bytes)
+{
+    size_t done = 0;
+    struct timespec ts;
+    int64_t timeout_ns;
+
+    /* the writer hands back space at least once per pcm buffer */
+    timeout_ns = (int64_t)out->config.period_size * out->config.period_count *
+            1000000000LL / out->config.rate;
+
+    for (;;) {
+        done += audio_ring_write(&out->ring, (const char *)data + done, bytes - done);
+        /* the mixer polls its tracks every period instead */
+        if (out->writer_running)
+            sem_post(&out->ring_data);
+        if (done == bytes)
+            return 0;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += timeout_ns % 1000000000;
+        ts.tv_sec += timeout_ns / 1000000000 + ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        if (sem_timedwait(&out->ring_space, &ts) != 0 && errno != EINTR) {
+            ALOGW("writer thread stalled, dropping %d bytes", (int)(bytes - done));
+            return -ETIMEDOUT;
+        }
+    }
+}
 
-    adev->active_output = out;
+struct out_mmap_source {
+    struct aml_stream_out *out;
+    int16_t *data;
+    size_t frames;
+    size_t written;
+    bool resample;
+};
 
-    if (adev->mode != AUDIO_MODE_IN_CALL) {
-        /* FIXME: only works if only one output can be active at a time */
-        select_devices(adev);
+/* resample or copy straight into the DMA buffer */
+static bool out_mmap_fill(void *cookie, void *dst, unsigned int *frames)
+{
+    struct out_mmap_source *src = (struct out_mmap_source *)cookie;
+    struct aml_stream_out *out = src->out;
+    size_t in_frames = src->frames;
+    size_t out_frames = *frames;
+
+    if (src->resample) {
+        out->resampler->resample_from_input(out->resampler,
+                                            src->data, &in_frames,
+                                            (int16_t *)dst, &out_frames);
+    } else {
+        if (out_frames > in_frames)
+            out_frames = in_frames;
+        in_frames = out_frames;
+        memcpy(dst, src->data, pcm_frames_to_bytes(out->pcm, out_frames));
     }
-    
-    card = get_aml_card();
+    src->data += in_frames * out->config.channels;
+    src->frames -= in_frames;
+    src->written += out_frames;
+    *frames = out_frames;
+    return src->frames > 0;
+}
+
+/*
+ * Pick the playback port for the current route and load its config. The
+ * fast, deep buffer and normal profiles only differ in their config: they
+ * all share PORT_MM, so one of them plays at a time and start_output_stream()
+ * takes the pcm over from a stream in deferred standby.
+ */
+static int out_select_port(struct aml_audio_device *adev, audio_output_flags_t flags,
+                           struct pcm_config *config)
+{
+    int port;
+
     if (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO){
-        port = get_pcm_bt_port();
-        out->config = pcm_config_bt;
+        port = get_pcm_bt_port(adev->card, false);
+        if (port < 0) {
+            ALOGE("no bluetooth playback pcm on card %d", adev->card);
+            return port;
+        }
+        *config = pcm_config_bt;
+    } else if (flags & AUDIO_OUTPUT_FLAG_FAST) {
+        *config = pcm_config_out_fast;
+        /* same rate as the stream, so there is no resampler in the path */
+        config->rate = pcm_config_out.rate;
+        return PORT_MM;
+    } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        *config = pcm_config_out_deep;
+        config->rate = pcm_config_out.rate;
+        return PORT_MM;
     } else {
         port = PORT_MM;
-        out->config = pcm_config_out;
+        *config = pcm_config_out;
     }
-    LOGFUNC("*%s, open card(%d) port(%d)-------", __FUNCTION__,card,port);
     //if(getprop_bool("media.libplayer.wfd")){
-    //    out->config.period_size = PERIOD_SIZE/2;
+    //    config->period_size = PERIOD_SIZE/2;
     //}
     //else{
-        out->config.period_size = PERIOD_SIZE;        
+        config->period_size = PERIOD_SIZE;        
     //}
+    config->start_threshold = config->period_size * PLAYBACK_PERIOD_COUNT;
+    config->avail_min = 0;//SHORT_PERIOD_SIZE;
+    return port;
+}
 
-    /* default to low power: will be corrected in out_write if necessary before first write to
-     * tinyalsa.
-     */
-    out->write_threshold = out->config.period_size*PLAYBACK_PERIOD_COUNT;
-    out->config.start_threshold = out->config.period_size * PLAYBACK_PERIOD_COUNT;
-    out->config.avail_min = 0;//SHORT_PERIOD_SIZE;
-    
-    out->pcm = pcm_open(card, port, PCM_OUT /*| PCM_MMAP | PCM_NOIRQ*/, &(out->config));
+/* open for mmap when asked to and possible, returns NULL on failure */
+static struct pcm *out_open_pcm(unsigned int card, unsigned int port,
+                                struct pcm_config *config, struct audio_mmap *mmap)
+{
+    struct pcm *pcm = NULL;
 
-    if (!pcm_is_ready(out->pcm)) {
-        ALOGE("cannot open pcm_out driver: %s", pcm_get_error(out->pcm));
-        pcm_close(out->pcm);
-        adev->active_output = NULL;
-        return -ENOMEM;
+    mmap->pcm = NULL;
+    if (getprop_bool(MMAP_PLAYBACK_PROPERTY)) {
+        pcm = pcm_open(card, port, PCM_OUT | PCM_MMAP | PCM_NOIRQ, config);
+        if (pcm_is_ready(pcm)) {
+            audio_mmap_init(mmap, pcm, config);
+        } else {
+            ALOGW("cannot open pcm_out for mmap: %s", pcm_get_error(pcm));
+            pcm_close(pcm);
+            pcm = NULL;
+        }
+    }
+    if (pcm == NULL)
+        pcm = pcm_open(card, port, PCM_OUT, config);
+
+    if (!pcm_is_ready(pcm)) {
+        ALOGE("cannot open pcm_out driver: %s", pcm_get_error(pcm));
+        pcm_close(pcm);
+        return NULL;
     }
+    return pcm;
+}
+
+/* must be called with the output stream mutex locked, once out->config is set */
+static int out_setup_resampler(struct aml_stream_out *out)
+{
+    int ret;
+
     if(out->config.rate != out_get_sample_rate(&out->stream.common)){
     
         LOGFUNC("%s(out->config.rate=%d, out->config.channels=%d)", 
@@ -533,12 +730,363 @@ static int start_output_stream(struct aml_stream_out *out)
         }
         out->buffer_frames = (pcm_config_out.period_size * out->config.rate) /
                 out_get_sample_rate(&out->stream.common) + 1;
-        out->buffer = malloc(pcm_frames_to_bytes(out->pcm, out->buffer_frames));
+        out->buffer = malloc(out->buffer_frames * out->config.channels * sizeof(int16_t));
         if (out->buffer == NULL){
             ALOGE("cannot malloc memory for out->buffer");
             return -ENOMEM;
         }
     }
+    if (out->resampler){
+        out->resampler->reset(out->resampler);
+    }
+    return 0;
+}
+
+/* must be called with the hw device mutex locked */
+static bool out_want_low_power(struct aml_stream_out *out)
+{
+    struct aml_audio_device *adev = out->dev;
+
+    /* capture keeps playback shallow for the echo canceller */
+    return (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) ||
+            (adev->low_power && !adev->active_input);
+}
+
+/*
+ * Periods to open a normal stream with. A pcm that is not mmap wakes its
+ * writer once per period whatever avail_min says, so low power needs large
+ * periods, and those can only change when the pcm is opened.
+ */
+static void out_set_periods(struct aml_stream_out *out, bool low_power)
+{
+    unsigned int buffer = PERIOD_SIZE * LOW_POWER_PERIOD_COUNT;
+
+    out->config.period_count = low_power ? LOW_POWER_LARGE_PERIOD_COUNT :
+            LOW_POWER_PERIOD_COUNT;
+    out->config.period_size = buffer / out->config.period_count;
+    /* start as soon as in normal mode, whatever the periods */
+    out->config.start_threshold = PERIOD_SIZE * PLAYBACK_PERIOD_COUNT;
+}
+
+/* whether a normal stream would get other periods if it was opened now */
+static bool out_periods_stale(struct aml_stream_out *out)
+{
+    if (!out->low_power_ok || (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) ||
+            out->mmap.pcm != NULL)
+        return false;
+    return out->config.period_count != (out_want_low_power(out) ?
+            LOW_POWER_LARGE_PERIOD_COUNT : LOW_POWER_PERIOD_COUNT);
+}
+
+/*
+ * In low power the driver runs nearly full; otherwise at most
+ * PLAYBACK_PERIOD_COUNT periods of PERIOD_SIZE are queued, which
+ * out_wait_threshold() enforces at once. The writer only wakes less often
+ * in mmap mode, where avail_min is in our hands, or once the pcm has been
+ * reopened with large periods, see out_set_periods().
+ * must be called with the output stream mutex locked
+ */
+static int out_set_low_power(struct aml_stream_out *out, bool low_power)
+{
+    unsigned int buffer = out->config.period_size * out->config.period_count;
+    int ret = 0;
+
+    if (low_power) {
+        out->write_threshold = buffer;
+        /* a quarter of the buffer is left when the writer wakes up */
+        out->config.avail_min = buffer - buffer / 4;
+    } else {
+        out->write_threshold = PERIOD_SIZE * PLAYBACK_PERIOD_COUNT;
+        out->config.avail_min = out->config.period_size;
+    }
+    if (out->mmap.pcm != NULL) {
+        audio_mmap_set_threshold(&out->mmap, out->write_threshold, out->config.avail_min);
+    } else {
+        ret = pcm_set_avail_min(out->pcm, out->config.avail_min);
+        if (ret != 0)
+            ALOGI("avail_min %u not applied (%d), the writer wakes every %u frames",
+                  out->config.avail_min, ret, out->config.period_size);
+    }
+    out->low_power = low_power;
+    return ret;
+}
+
+/* do not allow more than out->write_threshold frames in the driver */
+static void out_wait_threshold(struct aml_stream_out *out)
+{
+    struct timespec time_stamp;
+    unsigned int kernel_frames;
+    unsigned long time;
+
+    if (!out->low_power_ok)
+        return;
+    for (;;) {
+        /* fails until the pcm is started, which write_threshold allows */
+        if (pcm_get_htimestamp(out->pcm, &kernel_frames, &time_stamp) < 0)
+            return;
+        kernel_frames = pcm_get_buffer_size(out->pcm) - kernel_frames;
+        if (kernel_frames <= (unsigned int)out->write_threshold)
+            return;
+        time = (unsigned long)(((int64_t)(kernel_frames - out->write_threshold) * 1000000) /
+                out->config.rate);
+        if (time < MIN_WRITE_SLEEP_US)
+            time = MIN_WRITE_SLEEP_US;
+        usleep(time);
+    }
+}
+
+static void *mixer_thread(void *context)
+{
+    struct aml_mixer *mixer = (struct aml_mixer *)context;
+    size_t frame_size = mixer->config.channels * sizeof(int16_t);
+    size_t period = mixer->config.period_size * frame_size;
+    struct aml_stream_out *out;
+    struct sched_param param;
+    size_t bytes;
+    int i, ret;
+    int retries = 0;
+
+    param.sched_priority = WRITER_THREAD_PRIORITY;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+        ALOGW("mixer thread cannot get SCHED_FIFO, staying at normal priority");
+
+    /* one period per pass, paced by the pcm; a track short of data is
+     * padded with silence rather than holding up the others */
+    while (!android_atomic_acquire_load(&mixer->exit)) {
+        /* a period the pcm refused is written again before mixing more */
+        if (retries == 0) {
+            memset(mixer->mix_buffer, 0, period);
+            pthread_mutex_lock(&mixer->lock);
+            for (i = 0; i < MIXER_MAX_TRACKS; i++) {
+                out = mixer->tracks[i];
+                if (out == NULL)
+                    continue;
+                bytes = audio_ring_read(&out->ring, mixer->track_buffer, period);
+                if (bytes == 0)
+                    continue;
+                audio_mix_s16(mixer->mix_buffer, mixer->track_buffer, bytes / sizeof(int16_t));
+                android_atomic_add(bytes / frame_size, &out->frame_count);
+                sem_post(&out->ring_space);
+            }
+            pthread_mutex_unlock(&mixer->lock);
+        }
+
+        if (mixer->mmap.pcm != NULL)
+            ret = audio_mmap_copy(&mixer->mmap, mixer->mix_buffer, mixer->config.period_size);
+        else
+            ret = pcm_write(mixer->pcm, mixer->mix_buffer, period);
+        if (ret != 0) {
+            /* nothing paces this SCHED_FIFO thread but the pcm: wait out a
+             * period, recover from xrun or suspend and try again */
+            ALOGV("mixer thread: write error %s", pcm_get_error(mixer->pcm));
+            usleep((int64_t)mixer->config.period_size * 1000000 / mixer->config.rate);
+            if (mixer->mmap.pcm == NULL)
+                pcm_prepare(mixer->pcm);
+            if (++retries >= MIXER_MAX_RETRIES) {
+                ALOGW("mixer thread: dropping a period after %d write errors", retries);
+                retries = 0;
+            }
+            continue;
+        }
+        retries = 0;
+        /* under the lock, as put_echo_reference() frees it */
+        pthread_mutex_lock(&mixer->lock);
+        if (mixer->echo_reference != NULL)
+            echo_reference_write(mixer->echo_reference, mixer->pcm, &mixer->config,
+                    mixer->mix_buffer, mixer->config.period_size, 0);
+        pthread_mutex_unlock(&mixer->lock);
+    }
+    return NULL;
+}
+
+/* must be called with hw device mutex locked */
+static int mixer_start(struct aml_audio_device *adev)
+{
+    struct aml_mixer *mixer = &adev->mixer;
+    size_t period;
+    int port;
+
+    port = out_select_port(adev, AUDIO_OUTPUT_FLAG_NONE, &mixer->config);
+    if (port < 0)
+        return port;
+    LOGFUNC("*%s, open card(%d) port(%d)-------", __FUNCTION__, adev->card, port);
+    mixer->pcm = out_open_pcm(adev->card, port, &mixer->config, &mixer->mmap);
+    if (mixer->pcm == NULL)
+        return -ENOMEM;
+
+    period = pcm_frames_to_bytes(mixer->pcm, mixer->config.period_size);
+    mixer->mix_buffer = malloc(period);
+    mixer->track_buffer = malloc(period);
+    if (mixer->mix_buffer == NULL || mixer->track_buffer == NULL)
+        goto err;
+    mixer->exit = 0;
+    if (pthread_create(&mixer->thread, NULL, mixer_thread, mixer) != 0)
+        goto err;
+    mixer->running = true;
+    return 0;
+
+err:
+    free(mixer->mix_buffer);
+    free(mixer->track_buffer);
+    mixer->mix_buffer = NULL;
+    mixer->track_buffer = NULL;
+    pcm_close(mixer->pcm);
+    mixer->pcm = NULL;
+    mixer->mmap.pcm = NULL;
+    return -ENOMEM;
+}
+
+/* must be called with hw device mutex locked, once the last track is gone */
+static void mixer_stop(struct aml_audio_device *adev)
+{
+    struct aml_mixer *mixer = &adev->mixer;
+
+    android_atomic_release_store(1, &mixer->exit);
+    pthread_join(mixer->thread, NULL);
+    mixer->running = false;
+    pcm_close(mixer->pcm);
+    mixer->pcm = NULL;
+    mixer->mmap.pcm = NULL;
+    free(mixer->mix_buffer);
+    free(mixer->track_buffer);
+    mixer->mix_buffer = NULL;
+    mixer->track_buffer = NULL;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static int out_mixer_attach(struct aml_stream_out *out)
+{
+    struct aml_audio_device *adev = out->dev;
+    struct aml_mixer *mixer = &adev->mixer;
+    int i, ret;
+
+    if (!mixer->running) {
+        ret = mixer_start(adev);
+        if (ret != 0)
+            return ret;
+    }
+    /* the track converts to the mixer format before queueing */
+    out->config = mixer->config;
+    out->write_threshold = out->config.period_size * out->config.period_count;
+    out->low_power_ok = false;
+    ret = out_setup_resampler(out);
+
+    pthread_mutex_lock(&mixer->lock);
+    for (i = 0; ret == 0 && i < MIXER_MAX_TRACKS; i++) {
+        if (mixer->tracks[i] == NULL) {
+            mixer->tracks[i] = out;
+            mixer->track_count++;
+            break;
+        }
+    }
+    if (i == MIXER_MAX_TRACKS) {
+        ALOGE("no free mixer track for output %p", out);
+        ret = -EBUSY;
+    }
+    pthread_mutex_unlock(&mixer->lock);
+
+    if (ret != 0) {
+        if (mixer->track_count == 0)
+            mixer_stop(adev);
+        return ret;
+    }
+    out->mixed = true;
+    return 0;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static void out_mixer_detach(struct aml_stream_out *out)
+{
+    struct aml_audio_device *adev = out->dev;
+    struct aml_mixer *mixer = &adev->mixer;
+    struct aml_stream_out *next = NULL;
+    int i;
+
+    pthread_mutex_lock(&mixer->lock);
+    for (i = 0; i < MIXER_MAX_TRACKS; i++) {
+        if (mixer->tracks[i] == out) {
+            mixer->tracks[i] = NULL;
+            mixer->track_count--;
+        } else if (mixer->tracks[i] != NULL && next == NULL) {
+            next = mixer->tracks[i];
+        }
+    }
+    pthread_mutex_unlock(&mixer->lock);
+
+    /* the mixer no longer reads this ring */
+    out_ring_flush(out);
+    out->mixed = false;
+    if (adev->active_output == out)
+        adev->active_output = next;
+    if (mixer->track_count == 0)
+        mixer_stop(adev);
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static int start_output_stream(struct aml_stream_out *out)
+{
+    struct aml_audio_device *adev = out->dev;
+    unsigned int card = CARD_AMLOGIC_DEFAULT;
+    int port;
+    int ret;
+
+    LOGFUNC("%s(adev->out_device=%#x, adev->mode=%d)", __FUNCTION__, adev->out_device, adev->mode);
+
+    /* an output in deferred standby still holds its pcm open, release it
+     * before opening ours on what may be the same card and port */
+    if (adev->active_output != NULL && adev->active_output != out) {
+        struct aml_stream_out *prev = adev->active_output;
+
+        pthread_mutex_lock(&prev->lock);
+        if (prev->standby_pending)
+            do_output_standby(prev);
+        pthread_mutex_unlock(&prev->lock);
+    }
+
+    /* the echo reference takes one writer, from now on this output */
+    if (adev->active_output != NULL && adev->active_output != out &&
+            adev->echo_reference != NULL)
+        remove_echo_reference(adev->active_output, adev->echo_reference);
+    adev->active_output = out;
+
+    if (adev->mode != AUDIO_MODE_IN_CALL) {
+        /* FIXME: only works if only one output can be active at a time */
+        select_devices(adev);
+    }
+
+    if (adev->mixer.enabled) {
+        ret = out_mixer_attach(out);
+        if (ret != 0) {
+            adev->active_output = NULL;
+            return ret;
+        }
+        return 0;
+    }
+    
+    card = adev->card;
+    port = out_select_port(adev, out->flags, &out->config);
+    if (port < 0) {
+        adev->active_output = NULL;
+        return port;
+    }
+    /* bluetooth and fast streams keep their small buffer */
+    out->low_power_ok = port == PORT_MM && !(out->flags & AUDIO_OUTPUT_FLAG_FAST);
+    if (out->low_power_ok && !(out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER))
+        out_set_periods(out, out_want_low_power(out));
+    LOGFUNC("*%s, open card(%d) port(%d)-------", __FUNCTION__,card,port);
+
+    out->write_threshold = out->config.period_size * out->config.period_count;
+    
+    out->pcm = out_open_pcm(card, port, &out->config, &out->mmap);
+    if (out->pcm == NULL) {
+        adev->active_output = NULL;
+        return -ENOMEM;
+    }
+    if (out->low_power_ok)
+        out_set_low_power(out, out_want_low_power(out));
+    ret = out_setup_resampler(out);
+    if (ret != 0)
+        return ret;
 
     LOGFUNC("channels=%d---format=%d---period_count%d---period_size%d---rate=%d---",
                          out->config.channels, out->config.format, out->config.period_count, 
@@ -546,9 +1094,8 @@ static int start_output_stream(struct aml_stream_out *out)
 
     if (adev->echo_reference != NULL)
         out->echo_reference = adev->echo_reference;
-    if (out->resampler){
-        out->resampler->reset(out->resampler);
-    }
+    if (out->ring.base != NULL && out_writer_start(out) != 0)
+        ALOGW("cannot start writer thread, writing to the pcm directly");
 
     return 0;
 }
@@ -600,7 +1147,7 @@ static size_t get_input_buffer_size(uint32_t sample_rate, audio_format_t format,
 }
 
 static void add_echo_reference(struct aml_stream_out *out,
-                               struct echo_reference_itfe *reference)
+                               struct audio_echo_ref *reference)
 {
     pthread_mutex_lock(&out->lock);
     out->echo_reference = reference;
@@ -608,82 +1155,83 @@ static void add_echo_reference(struct aml_stream_out *out,
 }
 
 static void remove_echo_reference(struct aml_stream_out *out,
-                                  struct echo_reference_itfe *reference)
+                                  struct audio_echo_ref *reference)
 {
+    /* once out->lock is ours the output is not writing to it */
     pthread_mutex_lock(&out->lock);
-    if (out->echo_reference == reference) {
-        /* stop writing to echo reference */
-        reference->write(reference, NULL);
+    if (out->echo_reference == reference)
         out->echo_reference = NULL;
-    }
     pthread_mutex_unlock(&out->lock);
 }
 
+/* the mixer, when enabled, is the one writer of the echo reference */
+static void set_mixer_echo_reference(struct aml_mixer *mixer,
+                                     struct audio_echo_ref *reference)
+{
+    pthread_mutex_lock(&mixer->lock);
+    mixer->echo_reference = reference;
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+/* must be called with hw device mutex locked */
 static void put_echo_reference(struct aml_audio_device *adev,
-                          struct echo_reference_itfe *reference)
+                          struct audio_echo_ref *reference)
 {
     if (adev->echo_reference != NULL &&
             reference == adev->echo_reference) {
-        if (adev->active_output != NULL)
+        if (adev->mixer.enabled)
+            set_mixer_echo_reference(&adev->mixer, NULL);
+        else if (adev->active_output != NULL)
             remove_echo_reference(adev->active_output, reference);
-        release_echo_reference(reference);
+        audio_echo_ref_destroy(reference);
         adev->echo_reference = NULL;
     }
 }
 
-static struct echo_reference_itfe *get_echo_reference(struct aml_audio_device *adev,
+/* must be called with hw device mutex locked */
+static struct audio_echo_ref *get_echo_reference(struct aml_audio_device *adev,
                                                audio_format_t format,
                                                uint32_t channel_count,
                                                uint32_t sampling_rate)
 {
     put_echo_reference(adev, adev->echo_reference);
-    if (adev->active_output != NULL) {
-        struct audio_stream *stream = &adev->active_output->stream.common;
-        uint32_t wr_channel_count = popcount(stream->get_channels(stream));
-        uint32_t wr_sampling_rate = stream->get_sample_rate(stream);
-
-        int status = create_echo_reference(AUDIO_FORMAT_PCM_16_BIT,
-                                           channel_count,
-                                           sampling_rate,
-                                           AUDIO_FORMAT_PCM_16_BIT,
-                                           wr_channel_count,
-                                           wr_sampling_rate,
-                                           &adev->echo_reference);
-        if (status == 0)
-            add_echo_reference(adev->active_output, adev->echo_reference);
-    }
+    adev->echo_reference = audio_echo_ref_create(sampling_rate, channel_count,
+            MM_FULL_POWER_SAMPLING_RATE / 1000 * ECHO_REFERENCE_MS * 2 * sizeof(int16_t));
+    if (adev->echo_reference == NULL) {
+        ALOGE("cannot allocate the echo reference");
+        return NULL;
+    }
+    /* an output that starts later picks it up in start_output_stream() */
+    if (adev->mixer.enabled)
+        set_mixer_echo_reference(&adev->mixer, adev->echo_reference);
+    else if (adev->active_output != NULL)
+        add_echo_reference(adev->active_output, adev->echo_reference);
     return adev->echo_reference;
 }
 
-static int get_playback_delay(struct aml_stream_out *out,
-                       size_t frames,
-                       struct echo_reference_buffer *buffer)
+/*
+ * Hand frames that were just written to pcm, with ahead frames still
+ * queued in front of the pcm after them, to the echo reference. They are
+ * stamped with the time their first frame is played; until the pcm runs
+ * that is not known, and they are left out.
+ */
+static void echo_reference_write(struct audio_echo_ref *reference, struct pcm *pcm,
+                                 const struct pcm_config *config, const int16_t *data,
+                                 size_t frames, size_t ahead)
 {
+    struct timespec ts;
+    unsigned int queued;
+    int64_t time_us;
 
-    size_t kernel_frames;
-    int status;
-    status = pcm_get_htimestamp(out->pcm, &kernel_frames, &buffer->time_stamp);
-    if (status < 0) {
-        buffer->time_stamp.tv_sec  = 0;
-        buffer->time_stamp.tv_nsec = 0;
-        buffer->delay_ns           = 0;
-        ALOGV("get_playback_delay(): pcm_get_htimestamp error,"
-                "setting playbackTimestamp to 0");
-        return status;
-    }
-    kernel_frames = pcm_get_buffer_size(out->pcm) - kernel_frames;
-    ALOGV("~~pcm_get_buffer_size(out->pcm)=%d",pcm_get_buffer_size(out->pcm));
-    /* adjust render time stamp with delay added by current driver buffer.
-     * Add the duration of current frame as we want the render time of the last
-     * sample being written. */
-    buffer->delay_ns = (long)(((int64_t)(kernel_frames + frames)* 1000000000)/
-                            DEFAULT_OUT_SAMPLING_RATE);
-
-    ALOGV("get_playback_delay time_stamp = [%ld].[%ld], delay_ns: [%d],"
-         "kernel_frames:[%d]",
-        buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, buffer->delay_ns,
-        kernel_frames);
-    return 0;
+    if (audio_pcm_queued(pcm, &queued, &ts) != 0)
+        return;
+    queued += ahead;
+    time_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    if (queued > frames)
+        time_us += (int64_t)(queued - frames) * 1000000 / config->rate;
+    if (audio_echo_ref_write(reference, data, frames, config->rate, config->channels,
+            time_us) != 0)
+        ALOGV("echo reference full, dropping %u frames", (unsigned int)frames);
 }
 
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
@@ -736,11 +1284,20 @@ static int do_output_standby(struct aml_stream_out *out)
 
     LOGFUNC("%s(%p)", __FUNCTION__, out);
 
+    out->standby_pending = false;
+    audio_render_clock_reset(&out->render_clock, out_get_sample_rate(&out->stream.common));
     if (!out->standby) {
-        pcm_close(out->pcm);
-        out->pcm = NULL;
-        out->frame_count = 0;
-        adev->active_output = 0;
+        if (out->mixed) {
+            /* hands active_output over to another track */
+            out_mixer_detach(out);
+        } else {
+            out_writer_stop(out);
+            pcm_close(out->pcm);
+            out->pcm = NULL;
+            out->mmap.pcm = NULL;
+            adev->active_output = 0;
+        }
+        android_atomic_release_store(0, &out->frame_count);
 
         if (out->buffer){
             free(out->buffer);
@@ -760,10 +1317,7 @@ static int do_output_standby(struct aml_stream_out *out)
         }
 
         /* stop writing to echo reference */
-        if (out->echo_reference != NULL) {
-            out->echo_reference->write(out->echo_reference, NULL);
-            out->echo_reference = NULL;
-        }
+        out->echo_reference = NULL;
 
         out->standby = 1;
         output_standby = 1;
@@ -776,6 +1330,76 @@ static int do_output_standby(struct aml_stream_out *out)
     return 0;
 }
 
+/*
+ * Stop the DMA but keep the pcm, buffers and resampler, so that a write
+ * within standby_delay_ms restarts without reopening anything.
+ * must be called with hw device and output stream mutexes locked
+ */
+static int out_defer_standby(struct aml_stream_out *out)
+{
+    struct timespec *deadline = &out->standby_deadline;
+
+    if (!out->standby_pending) {
+        out_writer_stop(out);
+        pcm_stop(out->pcm);
+        /* prepare now so the restart does not reset what it already queued */
+        pcm_prepare(out->pcm);
+        out->mmap.running = false;
+        audio_render_clock_reset(&out->render_clock, out_get_sample_rate(&out->stream.common));
+        out->standby_pending = true;
+    }
+
+    pthread_mutex_lock(&out->standby_lock);
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += out->standby_delay_ms / 1000;
+    deadline->tv_nsec += (out->standby_delay_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+    out->standby_armed = true;
+    pthread_cond_signal(&out->standby_cond);
+    pthread_mutex_unlock(&out->standby_lock);
+    return 0;
+}
+
+/* closes the pcm of a deferred standby once its deadline passes */
+static void *out_standby_thread(void *context)
+{
+    struct aml_stream_out *out = (struct aml_stream_out *)context;
+    struct aml_audio_device *adev = out->dev;
+    struct timespec now;
+
+    pthread_mutex_lock(&out->standby_lock);
+    while (!out->standby_exit) {
+        if (!out->standby_armed) {
+            pthread_cond_wait(&out->standby_cond, &out->standby_lock);
+            continue;
+        }
+        if (pthread_cond_timedwait(&out->standby_cond, &out->standby_lock,
+                &out->standby_deadline) != ETIMEDOUT)
+            continue;
+        out->standby_armed = false;
+        pthread_mutex_unlock(&out->standby_lock);
+
+        pthread_mutex_lock(&adev->lock);
+        pthread_mutex_lock(&out->lock);
+        /* a write may have restarted the stream, or standby re-armed it */
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (out->standby_pending &&
+                (now.tv_sec > out->standby_deadline.tv_sec ||
+                (now.tv_sec == out->standby_deadline.tv_sec &&
+                now.tv_nsec >= out->standby_deadline.tv_nsec)))
+            do_output_standby(out);
+        pthread_mutex_unlock(&out->lock);
+        pthread_mutex_unlock(&adev->lock);
+
+        pthread_mutex_lock(&out->standby_lock);
+    }
+    pthread_mutex_unlock(&out->standby_lock);
+    return NULL;
+}
+
 static int out_standby(struct audio_stream *stream)
 {
     struct aml_stream_out *out = (struct aml_stream_out *)stream;
@@ -783,7 +1407,12 @@ static int out_standby(struct audio_stream *stream)
 
     pthread_mutex_lock(&out->dev->lock);
     pthread_mutex_lock(&out->lock);
-    status = do_output_standby(out);
+    /* a mixer track has no pcm of its own to keep open */
+    if (out->standby_delay_ms > 0 && !out->standby && !out->mixed &&
+            out->dev->mode != AUDIO_MODE_IN_CALL)
+        status = out_defer_standby(out);
+    else
+        status = do_output_standby(out);
     pthread_mutex_unlock(&out->lock);
     pthread_mutex_unlock(&out->dev->lock);
     return status;
@@ -791,7 +1420,17 @@ static int out_standby(struct audio_stream *stream)
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct aml_stream_out *out = (struct aml_stream_out *)stream;
+    char buffer[256];
+
     LOGFUNC("%s(%p, %d)", __FUNCTION__, stream, fd);
+    snprintf(buffer, sizeof(buffer),
+            "  standby delay: %u ms%s\n"
+            "  warm starts: %u\n"
+            "  cold starts: %u\n",
+            out->standby_delay_ms, out->standby_pending ? " (pending)" : "",
+            out->warm_starts, out->cold_starts);
+    write(fd, buffer, strlen(buffer));
     return 0;
 }
 
@@ -832,6 +1471,9 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
             }
             adev->out_device &= ~AUDIO_DEVICE_OUT_ALL;
             adev->out_device |= val;
+            adev_device_changed(adev);
+            /* device changes follow hotplug, pick up added or removed pcms */
+            audio_topology_refresh();
             select_devices(adev);
         }
         pthread_mutex_unlock(&out->lock);
@@ -873,7 +1515,9 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
             ALOGI("audio hw frame size change from %d to %d \n",PERIOD_SIZE,frame_size);
             PERIOD_SIZE = frame_size;///PLAYBACK_PERIOD_COUNT;
             pcm_config_out.period_size = PERIOD_SIZE;
-            out->config.period_size = PERIOD_SIZE;
+            /* the fast profile keeps its own period */
+            if (!(out->flags & AUDIO_OUTPUT_FLAG_FAST))
+                out->config.period_size = PERIOD_SIZE;
             pthread_mutex_lock(&adev->lock);
             pthread_mutex_lock(&out->lock);         
             if(!out->standby && (out == adev->active_output)){
@@ -902,24 +1546,64 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
     struct aml_stream_out *out = (struct aml_stream_out *)stream;    
 		uint32_t whole_latency;
 		uint32_t ret;
+		uint32_t ring_latency = 0;
 		
 		whole_latency = (out->config.period_size * out->config.period_count * 1000) / out->config.rate;
+		/* the writer ring runs full in steady state */
+		if (out->ring.base != NULL)
+			ring_latency = out->ring.size / (out->config.channels * 2) * 1000 / out->config.rate;
 		
     if (!out->pcm || !pcm_is_ready(out->pcm))
-        return whole_latency;
+        return whole_latency + ring_latency;
+    /* the driver is kept from filling beyond write_threshold */
+    if (out->low_power_ok)
+        return (out->write_threshold * 1000) / out->config.rate + ring_latency;
 
 		ret = pcm_get_latency(out->pcm);
 		
 		if(ret == -1){
-			return whole_latency;
+			return whole_latency + ring_latency;
 		}
-    return ret;
+    return ret + ring_latency;
+}
+
+/*
+ * Stream frames written but not played yet: in the driver, in the writer or
+ * mixer ring and in the resampler, with the time that was measured at.
+ * must be called with the output stream mutex locked
+ */
+static int out_get_held_frames(struct aml_stream_out *out, uint64_t *held,
+                               struct timespec *timestamp)
+{
+    uint32_t rate = out_get_sample_rate(&out->stream.common);
+    /* a mixer track is delayed by the mixer pcm, held open while it is attached */
+    struct pcm *pcm = out->mixed ? out->dev->mixer.pcm : out->pcm;
+    unsigned int queued;
+    int64_t frames;
+
+    if (pcm == NULL || out->standby_pending ||
+            audio_pcm_queued(pcm, &queued, timestamp) != 0)
+        return -ENODATA;
+    frames = queued;
+    if (out->writer_running || out->mixed)
+        frames += audio_ring_used(&out->ring) / pcm_frames_to_bytes(pcm, 1);
+    /* device frames back to stream frames */
+    frames = frames * rate / out->config.rate;
+    if (out->resampler)
+        frames += (int64_t)out->resampler->delay_ns(out->resampler) * rate / 1000000000;
+    *held = frames > 0 ? frames : 0;
+    return 0;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
                           float right)
 {
-    return -ENOSYS;
+    struct aml_stream_out *out = (struct aml_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    audio_volume_set(&out->volume, left, right);
+    pthread_mutex_unlock(&out->lock);
+    return 0;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -941,49 +1625,61 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     uint i, total_len;
     //LOGFUNC("entring:%s(out->echo_reference=%p, in_frames=%d)", __FUNCTION__, out->echo_reference, in_frames);
 
-    /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-     * on the output stream mutex - e.g. executing select_mode() while holding the hw device
-     * mutex
+    /* the steady state only needs the stream; standby transitions and device
+     * changes also need the hw device mutex, which comes first in lock order
      */
-    pthread_mutex_lock(&adev->lock);
     pthread_mutex_lock(&out->lock);
-    #if 1
-    #define DOLBY_SYSTEM_CHANNEL "ds1.audio.multichannel.support"
-    char value[128]={0};
-    property_get(DOLBY_SYSTEM_CHANNEL,value,NULL);
-    if((!strcmp(value,"true") ||!strcmp(value,"1")) && out->config.channels!=8)
-    {     
-        if (!out->standby) {
-               ALOGI("[%s %d]8ch PCM output,standby other outputs/%p...\n",__FUNCTION__,__LINE__,out);
-               pcm_close(out->pcm);
-               out->pcm = NULL;
-               out->frame_count = 0;
-               adev->active_output = 0;
-               if (out->echo_reference != NULL) {/* stop writing to echo reference */
-                   out->echo_reference->write(out->echo_reference, NULL);
-                   out->echo_reference = NULL;
-               }
-               out->standby = 1;
-               output_standby = 1;
-          }
-          pthread_mutex_unlock(&adev->lock);
-          goto exit;
-    }
-    #endif
-    if (out->standby) {
-        ret = start_output_stream(out);
-        if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
-            goto exit;
+    if (out->standby || out->standby_pending ||
+            out->device_seq != android_atomic_acquire_load(&adev->device_seq) ||
+            (audio_props_get()->multichannel && out->config.channels != 8)) {
+        pthread_mutex_unlock(&out->lock);
+        pthread_mutex_lock(&adev->lock);
+        pthread_mutex_lock(&out->lock);
+        out->device_seq = adev->device_seq;
+        #if 1
+        if(audio_props_get()->multichannel && out->config.channels!=8)
+        {     
+            if (!out->standby) {
+                   ALOGI("[%s %d]8ch PCM output,standby other outputs/%p...\n",__FUNCTION__,__LINE__,out);
+                   do_output_standby(out);
+              }
+              pthread_mutex_unlock(&adev->lock);
+              goto exit;
+        }
+        #endif
+        /* a warm start would keep periods of the wrong size, reopen instead */
+        if (out->standby_pending && out_periods_stale(out))
+            do_output_standby(out);
+        if (out->standby_pending) {
+            /* still open from a deferred standby */
+            out->standby_pending = false;
+            out->warm_starts++;
+            if (out->resampler)
+                out->resampler->reset(out->resampler);
+            if (out->ring.base != NULL && out_writer_start(out) != 0)
+                ALOGW("cannot restart writer thread, writing to the pcm directly");
+        } else if (out->standby) {
+            ret = start_output_stream(out);
+            if (ret != 0) {
+                pthread_mutex_unlock(&adev->lock);
+                goto exit;
+            }
+            out->cold_starts++;
+            out->standby = false;
+            output_standby = false;
+            /* a change in output device may change the microphone selection */
+            if (adev->active_input &&
+                    adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
+                force_input_standby = true;
         }
-        out->standby = false;
-        output_standby = false;
-        /* a change in output device may change the microphone selection */
-        if (adev->active_input &&
-                adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
-            force_input_standby = true;
+        /* the periods follow at the next start, see out_set_periods() */
+        if (out->low_power_ok) {
+            bool low_power = out_want_low_power(out);
+            if (low_power != out->low_power)
+                out_set_low_power(out, low_power);
+        }
+        pthread_mutex_unlock(&adev->lock);
     }
-    pthread_mutex_unlock(&adev->lock);
 #if 1
     /* Reduce number of channels, if necessary */
     if (popcount(out_get_channels(&stream->common)) >
@@ -998,8 +1694,30 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         frame_size /= 2;
     }
 #endif
+    /* before resampling, so that it runs on the stream rate and channels */
+    if (!audio_volume_is_unity(&out->volume)) {
+        if (out->volume_buf_size < bytes) {
+            int16_t *volume_buf = realloc(out->volume_buf, bytes);
+
+            if (volume_buf != NULL) {
+                out->volume_buf = volume_buf;
+                out->volume_buf_size = bytes;
+            }
+        }
+        if (out->volume_buf_size >= bytes) {
+            audio_volume_apply(&out->volume, in_buffer, out->volume_buf, in_frames,
+                               frame_size / sizeof(int16_t));
+            in_buffer = out->volume_buf;
+        } else {
+            ALOGW("no memory to apply the volume, writing unscaled");
+        }
+    }
     /* only use resampler if required */
-    if (out->config.rate != out_get_sample_rate(&stream->common)) {
+    if (out->config.rate != out_get_sample_rate(&stream->common) &&
+            out->mmap.pcm != NULL && !out->writer_running && out->echo_reference == NULL) {
+        /* resampled straight into the DMA buffer below */
+        out_frames = in_frames * out->config.rate / out_get_sample_rate(&stream->common);
+    } else if (out->config.rate != out_get_sample_rate(&stream->common)) {
         out_frames = out->buffer_frames;
         out->resampler->resample_from_input(out->resampler,
                                             in_buffer, &in_frames,
@@ -1008,14 +1726,6 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     } else {
         out_frames = in_frames;
     }
-    if (out->echo_reference != NULL) {
-
-        struct echo_reference_buffer b;
-        b.raw = (void *)buffer;
-        b.frame_count = in_frames;
-        get_playback_delay(out, out_frames, &b);
-        out->echo_reference->write(out->echo_reference, &b);
-    }
 
 #if 0   
         FILE *fp1=fopen("/data/audio_out","a+"); 
@@ -1064,9 +1774,40 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         ret = pcm_write(out->pcm, in_buffer, out_frames * frame_size);
     }
 #else
-    ret = pcm_write(out->pcm, in_buffer, out_frames * frame_size);
-    out->frame_count += out_frames;
+    if (out->writer_running || out->mixed) {
+        ret = out_writer_queue(out, in_buffer, out_frames * frame_size);
+    } else if (out->mmap.pcm != NULL) {
+        struct out_mmap_source src;
+
+        src.out = out;
+        src.data = in_buffer;
+        /* already resampled for the echo reference */
+        src.resample = out->resampler != NULL && in_buffer != (int16_t *)out->buffer;
+        src.frames = src.resample ? in_frames : out_frames;
+        src.written = 0;
+        ret = audio_mmap_write(&out->mmap, out_mmap_fill, &src);
+        android_atomic_add(src.written, &out->frame_count);
+        out_frames = src.written;
+    } else {
+        out_wait_threshold(out);
+        ret = pcm_write(out->pcm, in_buffer, out_frames * frame_size);
+        android_atomic_add(out_frames, &out->frame_count);
+    }
 #endif
+    /* what went to the pcm, after resampling and volume */
+    if (ret == 0 && out->echo_reference != NULL)
+        echo_reference_write(out->echo_reference, out->pcm, &out->config, in_buffer,
+                out_frames, out->writer_running ?
+                        audio_ring_used(&out->ring) / pcm_frames_to_bytes(out->pcm, 1) : 0);
+    if (ret == 0) {
+        struct timespec ts;
+        uint64_t held;
+
+        out->frames_written += bytes / audio_stream_frame_size(&stream->common);
+        if (out_get_held_frames(out, &held, &ts) == 0)
+            audio_render_clock_update(&out->render_clock,
+                    bytes / audio_stream_frame_size(&stream->common), held, &ts);
+    }
     exit:
         pthread_mutex_unlock(&out->lock);
         //fixed me: It is not a good way to clear android audioflinger buffer,but when pcm write error, audioflinger can't break out.
@@ -1094,11 +1835,26 @@ static int out_get_render_position(const struct audio_stream_out *stream,
 {
     struct aml_stream_out *out = (struct aml_stream_out *)stream;
 
-    *dsp_frames = out->frame_count;
+    *dsp_frames = android_atomic_acquire_load(&out->frame_count);
 	
     return 0;
 }
 
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp)
+{
+    struct aml_stream_out *out = (struct aml_stream_out *)stream;
+    uint64_t held;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_held_frames(out, &held, timestamp);
+    if (ret == 0)
+        *frames = held < out->frames_written ? out->frames_written - held : 0;
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
     return 0;
@@ -1111,7 +1867,13 @@ static int out_remove_audio_effect(const struct audio_stream *stream, effect_han
 static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
                                         int64_t *timestamp)
 {
-    return -EINVAL;
+    struct aml_stream_out *out = (struct aml_stream_out *)stream;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = audio_render_clock_next(&out->render_clock, timestamp);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
 }
 
 static int get_next_buffer(struct resampler_buffer_provider *buffer_provider, 
@@ -1133,26 +1895,34 @@ static int start_input_stream(struct aml_stream_in *in)
     LOGFUNC("%s(need_echo_reference=%d, channels=%d, rate=%d, requested_rate=%d, mode= %d)", 
         __FUNCTION__, in->need_echo_reference, in->config.channels, in->config.rate, in->requested_rate, adev->mode);
     adev->active_input = in;
+    adev_device_changed(adev);
 
     if (adev->mode != AUDIO_MODE_IN_CALL) {
         adev->in_device &= ~AUDIO_DEVICE_IN_ALL;
         adev->in_device |= in->device;
         select_devices(adev);
     }
-    card = get_aml_card();
+    card = adev->card;
 
     ALOGV("%s(in->requested_rate=%d, in->config.rate=%d)", 
              __FUNCTION__, in->requested_rate, in->config.rate);
     if (adev->in_device & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET){
-        port = get_pcm_bt_port();
-    } else if(getprop_bool("sys.hdmiIn.Capture")){
-        port = get_spdif_port();
+        ret = get_pcm_bt_port(card, true);
+    } else if(audio_props_get()->hdmiin_capture){
+        ret = get_spdif_port(card, true);
     } else {
-        port = PORT_MM;
+        ret = PORT_MM;
     }
+    if (ret < 0) {
+        ALOGE("no capture pcm for input device %#x on card %d", adev->in_device, card);
+        adev->active_input = NULL;
+        adev_device_changed(adev);
+        return ret;
+    }
+    port = ret;
     LOGFUNC("*%s, open card(%d) port(%d)-------", __FUNCTION__,card,port);
 
-    if(getprop_bool("media.libplayer.wfd")){
+    if(audio_props_get()->wfd){
         CAPTURE_PERIOD_SIZE = DEFAULT_CAPTURE_PERIOD_SIZE/2;
         in->config.period_size = CAPTURE_PERIOD_SIZE;
     }
@@ -1174,6 +1944,7 @@ static int start_input_stream(struct aml_stream_in *in)
         ALOGE("cannot open pcm_in driver: %s", pcm_get_error(in->pcm));
         pcm_close(in->pcm);
         adev->active_input = NULL;
+        adev_device_changed(adev);
         return -ENOMEM;
     }
     ALOGD("pcm_open in: card(%d), port(%d)", card, port);
@@ -1239,14 +2010,13 @@ static int do_input_standby(struct aml_stream_in *in)
         in->pcm = NULL;
 
         adev->active_input = 0;
+        adev_device_changed(adev);
         if (adev->mode != AUDIO_MODE_IN_CALL) {
             adev->in_device &= ~AUDIO_DEVICE_IN_ALL;
             //select_input_device(adev);
         }
 
         if (in->echo_reference != NULL) {
-            /* stop reading from echo reference */
-            in->echo_reference->read(in->echo_reference, NULL);
             put_echo_reference(adev, in->echo_reference);
             in->echo_reference = NULL;
         }
@@ -1360,25 +2130,24 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
     return 0;
 }
 
-static void get_capture_delay(struct aml_stream_in *in,
-                       size_t frames,
-                       struct echo_reference_buffer *buffer)
+/* CLOCK_MONOTONIC time, in microseconds, at which in->proc_buf[0] was captured */
+static int get_capture_time(struct aml_stream_in *in, int64_t *time_us)
 {
     /* read frames available in kernel driver buffer */
-    size_t kernel_frames;
+    unsigned int kernel_frames;
     struct timespec tstamp;
     long buf_delay;
     long rsmp_delay;
     long kernel_delay;
     long delay_ns;
     int rsmp_mul = in->config.rate/VX_NB_SAMPLING_RATE;
-    if (pcm_get_htimestamp(in->pcm, &kernel_frames, &tstamp) < 0) {
-        buffer->time_stamp.tv_sec  = 0;
-        buffer->time_stamp.tv_nsec = 0;
-        buffer->delay_ns           = 0;
-        ALOGW("read get_capture_delay(): pcm_htimestamp error");
-        return;
+    if (audio_pcm_queued(in->pcm, &kernel_frames, &tstamp) < 0) {
+        ALOGW("read get_capture_time(): pcm_htimestamp error");
+        return -ENODATA;
     }
+    /* audio_pcm_queued() counts for playback, on capture the frames waiting
+     * to be read are the rest of the buffer */
+    kernel_frames = pcm_get_buffer_size(in->pcm) - kernel_frames;
 
     /* read frames available in audio HAL input buffer
      * add number of frames being read as we want the capture time of first sample
@@ -1395,24 +2164,24 @@ static void get_capture_delay(struct aml_stream_in *in,
 
     delay_ns = kernel_delay + buf_delay + rsmp_delay;
 
-    buffer->time_stamp = tstamp;
-    buffer->delay_ns   = delay_ns;
-    ALOGV("get_capture_delay time_stamp = [%ld].[%ld], delay_ns: [%d],"
+    *time_us = (int64_t)tstamp.tv_sec * 1000000 + (tstamp.tv_nsec - delay_ns) / 1000;
+    ALOGV("get_capture_time time_stamp = [%ld].[%ld], delay_ns: [%ld],"
         " kernel_delay:[%ld], buf_delay:[%ld], rsmp_delay:[%ld], kernel_frames:[%d], "
-         "in->frames_in:[%d], in->proc_frames_in:[%d], frames:[%d]",
-         buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, buffer->delay_ns,
+         "in->frames_in:[%d], in->proc_frames_in:[%d]",
+         tstamp.tv_sec , tstamp.tv_nsec, delay_ns,
          kernel_delay, buf_delay, rsmp_delay, kernel_frames,
-         in->frames_in, in->proc_frames_in, frames);
-
+         in->frames_in, in->proc_frames_in);
+    return 0;
 }
 
+/* returns the echo delay left over after aligning the reference, in ns */
 static int32_t update_echo_reference(struct aml_stream_in *in, size_t frames)
 {
-    struct echo_reference_buffer b;
-    b.delay_ns = 0;
+    int64_t time_us;
+    int32_t offset_us = 0;
 
     ALOGV("update_echo_reference, frames = [%d], in->ref_frames_in = [%d],  "
-          "b.frame_count = [%d]",
+          "missing = [%d]",
          frames, in->ref_frames_in, frames - in->ref_frames_in);
     if (in->ref_frames_in < frames) {
         if (in->ref_buf_size < frames) {
@@ -1422,22 +2191,23 @@ static int32_t update_echo_reference(struct aml_stream_in *in, size_t frames)
                                                  in->config.channels * sizeof(int16_t));
         }
 
-        b.frame_count = frames - in->ref_frames_in;
-        b.raw = (void *)(in->ref_buf + in->ref_frames_in * in->config.channels);
-
-        get_capture_delay(in, frames, &b);
-        LOGFUNC("update_echo_reference  return ::b.delay_ns=%d", b.delay_ns);
-
-        if (in->echo_reference->read(in->echo_reference, &b) == 0)
-        {
-            in->ref_frames_in += b.frame_count;
-            ALOGV("update_echo_reference: in->ref_frames_in:[%d], "
-                    "in->ref_buf_size:[%d], frames:[%d], b.frame_count:[%d]",
-                 in->ref_frames_in, in->ref_buf_size, frames, b.frame_count);
+        /* the reference for in->ref_buf lines up with in->proc_buf */
+        if (get_capture_time(in, &time_us) == 0) {
+            time_us += (int64_t)in->ref_frames_in * 1000000 / in->requested_rate;
+            audio_echo_ref_read(in->echo_reference,
+                                in->ref_buf + in->ref_frames_in * in->config.channels,
+                                frames - in->ref_frames_in, time_us, &offset_us);
+        } else {
+            memset(in->ref_buf + in->ref_frames_in * in->config.channels, 0,
+                   (frames - in->ref_frames_in) * in->config.channels * sizeof(int16_t));
         }
+        in->ref_frames_in = frames;
+        ALOGV("update_echo_reference: in->ref_frames_in:[%d], "
+                "in->ref_buf_size:[%d], frames:[%d], offset_us:[%d]",
+             in->ref_frames_in, in->ref_buf_size, frames, offset_us);
     } else
         ALOGW("update_echo_reference: NOT enough frames to read ref buffer");
-    return b.delay_ns;
+    return offset_us * 1000;
 }
 
 static int set_preprocessor_param(effect_handle_t handle,
@@ -1675,20 +2445,23 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         struct aml_audio_device *adev = in->dev;
         size_t frames_rq = bytes / audio_stream_frame_size(&stream->common);
 
-        /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-         * on the input stream mutex - e.g. executing select_mode() while holding the hw device
-         * mutex
+        /* only starting the stream needs the hw device mutex, which comes first
+         * in lock order
          */
-        pthread_mutex_lock(&adev->lock);
         pthread_mutex_lock(&in->lock);
         if (in->standby) {
-            ret = start_input_stream(in);
-            if (ret == 0){
-                in->standby = 0;
-                input_standby = false;
+            pthread_mutex_unlock(&in->lock);
+            pthread_mutex_lock(&adev->lock);
+            pthread_mutex_lock(&in->lock);
+            if (in->standby) {
+                ret = start_input_stream(in);
+                if (ret == 0){
+                    in->standby = 0;
+                    input_standby = false;
+                }
             }
+            pthread_mutex_unlock(&adev->lock);
         }
-        pthread_mutex_unlock(&adev->lock);
 
         if (ret < 0)
             goto exit;
@@ -1825,11 +2598,20 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     struct aml_audio_device *ladev = (struct aml_audio_device *)dev;
     struct aml_stream_out *out;
     int channel_count = popcount(config->channel_mask);
+    char value[PROPERTY_VALUE_MAX];
     int ret;
 
     LOGFUNC("**enter %s(devices=0x%04x,format=%d, ch=0x%04x, SR=%d)", __FUNCTION__, devices,
                         config->format, config->channel_mask, config->sample_rate);
 
+    /* every mixer track sits behind a ring and the mixer period, so there is
+     * no low latency path to offer: refuse rather than open a slow "fast"
+     * output, the policy then keeps those tracks on the primary output */
+    if (ladev->mixer.enabled && (flags & AUDIO_OUTPUT_FLAG_FAST)) {
+        ALOGE("AUDIO_OUTPUT_FLAG_FAST is not supported with %s set", HAL_MIXER_PROPERTY);
+        return -EINVAL;
+    }
+
     out = (struct aml_stream_out *)calloc(1, sizeof(struct aml_stream_out));
     if (!out)
         return -ENOMEM;
@@ -1850,13 +2632,52 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.set_volume = out_set_volume;
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
+    out->stream.get_presentation_position = out_get_presentation_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
-    out->config = pcm_config_out;
+    /* mixer tracks all run at the mixer period, a deep buffer gains nothing there */
+    if (ladev->mixer.enabled)
+        flags &= ~AUDIO_OUTPUT_FLAG_DEEP_BUFFER;
+    out->flags = flags;
+    if (flags & AUDIO_OUTPUT_FLAG_FAST) {
+        out->config = pcm_config_out_fast;
+        out->config.rate = pcm_config_out.rate;
+    } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        out->config = pcm_config_out_deep;
+        out->config.rate = pcm_config_out.rate;
+    } else {
+        out->config = pcm_config_out;
+    }
 
     out->dev = ladev;
     out->standby = true;
     output_standby = true;
     out->frame_count = 0;
+    audio_volume_init(&out->volume, out_get_sample_rate(&out->stream.common));
+    audio_render_clock_reset(&out->render_clock, out_get_sample_rate(&out->stream.common));
+
+    /* a fast stream would lose its low latency behind the writer ring */
+    if ((getprop_bool(WRITER_THREAD_PROPERTY) && !(flags & AUDIO_OUTPUT_FLAG_FAST)) ||
+            ladev->mixer.enabled) {
+        ret = audio_ring_init(&out->ring, WRITER_RING_PERIODS *
+                out->config.period_size * out->config.channels * sizeof(int16_t));
+        if (ret != 0) {
+            free(out);
+            return ret;
+        }
+        sem_init(&out->ring_data, 0, 0);
+        sem_init(&out->ring_space, 0, 0);
+    }
+
+    property_get(STANDBY_DELAY_PROPERTY, value, "0");
+    out->standby_delay_ms = atoi(value);
+    if (out->standby_delay_ms > 0) {
+        pthread_mutex_init(&out->standby_lock, NULL);
+        pthread_cond_init(&out->standby_cond, NULL);
+        if (pthread_create(&out->standby_thread, NULL, out_standby_thread, out) != 0) {
+            ALOGW("cannot start standby thread, closing the pcm at standby");
+            out->standby_delay_ms = 0;
+        }
+    }
 
    /* FIXME: when we support multiple output devices, we will want to
       * do the following:
@@ -1888,7 +2709,24 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     struct aml_stream_out *out = (struct aml_stream_out *)stream;
 
     LOGFUNC("%s(%p, %p)", __FUNCTION__, dev, stream);
+    if (out->standby_delay_ms > 0) {
+        pthread_mutex_lock(&out->standby_lock);
+        out->standby_exit = true;
+        pthread_cond_signal(&out->standby_cond);
+        pthread_mutex_unlock(&out->standby_lock);
+        pthread_join(out->standby_thread, NULL);
+        pthread_cond_destroy(&out->standby_cond);
+        pthread_mutex_destroy(&out->standby_lock);
+        /* close now rather than deferring */
+        out->standby_delay_ms = 0;
+    }
     out_standby(&stream->common);
+    if (out->ring.base != NULL) {
+        sem_destroy(&out->ring_data);
+        sem_destroy(&out->ring_space);
+        audio_ring_release(&out->ring);
+    }
+    free(out->volume_buf);
     free(stream);
 }
 
@@ -1905,10 +2743,13 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
     parms = str_parms_create_str(kvpairs);
     ret = str_parms_get_str(parms, "screen_state", value, sizeof(value));
     if (ret >= 0) {
+        pthread_mutex_lock(&adev->lock);
         if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
             adev->low_power = false;
         else
             adev->low_power = true;
+        adev_device_changed(adev);
+        pthread_mutex_unlock(&adev->lock);
     }
 
     str_parms_destroy(parms);
@@ -1959,6 +2800,7 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
     pthread_mutex_lock(&adev->lock);
     if (adev->mode != mode) {
         adev->mode = mode;
+        adev_device_changed(adev);
         select_mode(adev);
     }
     pthread_mutex_unlock(&adev->lock);
@@ -2130,6 +2972,7 @@ static int adev_close(hw_device_t *device)
     struct aml_audio_device *adev = (struct aml_audio_device *)device;
 
     audio_route_free(adev->ar);
+    pthread_mutex_destroy(&adev->mixer.lock);
     free(device);
     return 0;
 }
@@ -2148,6 +2991,9 @@ static int adev_open(const hw_module_t* module, const char* name,
     if (!adev)
         return -ENOMEM;
 
+    /* ds1/hdmiIn/wfd properties are read from a snapshot on the audio paths */
+    audio_props_start();
+
     adev->hw_device.common.tag = HARDWARE_DEVICE_TAG;
     adev->hw_device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
     adev->hw_device.common.module = (struct hw_module_t *) module;
@@ -2170,6 +3016,7 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->hw_device.open_input_stream = adev_open_input_stream;
     adev->hw_device.close_input_stream = adev_close_input_stream;
     adev->hw_device.dump = adev_dump;
+    audio_topology_refresh();
     card = get_aml_card();
     if ((card < 0)||(card > 7)){
         ALOGE("error to get audio card");
@@ -2179,6 +3026,9 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->card = card;
     adev->ar = audio_route_init(adev->card, MIXER_XML_PATH);
 
+    pthread_mutex_init(&adev->mixer.lock, NULL);
+    adev->mixer.enabled = getprop_bool(HAL_MIXER_PROPERTY);
+
     /* Set the default route before the PCM stream is opened */
     adev->mode = AUDIO_MODE_NORMAL;
     adev->out_device = AUDIO_DEVICE_OUT_SPEAKER;
@@ -0,0 +1,32 @@
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define MIX_NEON 1
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define MIX_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "audio_mix.h"
+
+void audio_mix_s16(int16_t *dst, const int16_t *src, size_t samples)
+{
+    int32_t sum;
+
+#if defined(MIX_NEON)
+    for (; samples >= 8; samples -= 8, dst += 8, src += 8)
+        vst1q_s16(dst, vqaddq_s16(vld1q_s16(dst), vld1q_s16(src)));
+#elif defined(MIX_SSE2)
+    for (; samples >= 8; samples -= 8, dst += 8, src += 8)
+        _mm_storeu_si128((__m128i *)dst,
+                _mm_adds_epi16(_mm_loadu_si128((const __m128i *)dst),
+                               _mm_loadu_si128((const __m128i *)src)));
+#endif
+    for (; samples > 0; samples--, dst++, src++) {
+        sum = *dst + *src;
+        if (sum > INT16_MAX)
+            sum = INT16_MAX;
+        else if (sum < INT16_MIN)
+            sum = INT16_MIN;
+        *dst = sum;
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef __AUDIO_MIX_H__
+#define __AUDIO_MIX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* dst[i] = saturate(dst[i] + src[i]) over samples 16-bit samples */
+void audio_mix_s16(int16_t *dst, const int16_t *src, size_t samples);
+
+#endif
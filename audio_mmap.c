@@ -0,0 +1,131 @@
+#define LOG_TAG "audio_mmap"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "audio_mmap.h"
+
+/* floor for the timer sleeps, shorter ones mostly measure timer slack */
+#define MMAP_MIN_SLEEP_US 1000
+
+void audio_mmap_init(struct audio_mmap *mmap, struct pcm *pcm,
+        const struct pcm_config *config)
+{
+    mmap->pcm = pcm;
+    mmap->rate = config->rate;
+    mmap->buffer_frames = pcm_get_buffer_size(pcm);
+    mmap->fill_frames = mmap->buffer_frames;
+    mmap->start_threshold = config->start_threshold;
+    if (mmap->start_threshold == 0 || mmap->start_threshold > mmap->buffer_frames)
+        mmap->start_threshold = mmap->buffer_frames;
+    /* wake twice per period, finer than the interrupts we gave up */
+    mmap->wake_frames = config->period_size / 2;
+    if (mmap->wake_frames == 0)
+        mmap->wake_frames = 1;
+    mmap->running = false;
+}
+
+void audio_mmap_set_threshold(struct audio_mmap *mmap, unsigned int fill_frames,
+        unsigned int wake_frames)
+{
+    if (fill_frames == 0 || fill_frames > mmap->buffer_frames)
+        fill_frames = mmap->buffer_frames;
+    if (wake_frames == 0)
+        wake_frames = 1;
+    mmap->fill_frames = fill_frames;
+    mmap->wake_frames = wake_frames;
+}
+
+/* returns the frames the hardware has room for, recovering from underruns */
+static int mmap_avail(struct audio_mmap *mmap)
+{
+    int avail = pcm_mmap_avail(mmap->pcm);
+
+    if (avail < 0 || (unsigned int)avail > mmap->buffer_frames) {
+        ALOGV("mmap underrun, avail %d", avail);
+        mmap->running = false;
+        if (pcm_prepare(mmap->pcm) != 0)
+            return -EIO;
+        avail = pcm_mmap_avail(mmap->pcm);
+    }
+    return avail;
+}
+
+int audio_mmap_write(struct audio_mmap *mmap, audio_mmap_fill_t fill, void *cookie)
+{
+    unsigned int offset, frames;
+    void *areas;
+    bool more = true;
+    int64_t sleep_us;
+    int avail, room, ret;
+
+    while (more) {
+        avail = mmap_avail(mmap);
+        if (avail < 0)
+            return avail;
+        /* the part of the buffer above fill_frames stays empty */
+        room = avail - (int)(mmap->buffer_frames - mmap->fill_frames);
+        if (room <= 0) {
+            /* the buffer is full: the hardware has to be running */
+            if (!mmap->running) {
+                if (pcm_start(mmap->pcm) != 0)
+                    return -EIO;
+                mmap->running = true;
+            }
+            sleep_us = (int64_t)mmap->wake_frames * 1000000 / mmap->rate;
+            usleep(sleep_us > MMAP_MIN_SLEEP_US ? sleep_us : MMAP_MIN_SLEEP_US);
+            continue;
+        }
+
+        frames = room;
+        ret = pcm_mmap_begin(mmap->pcm, &areas, &offset, &frames);
+        if (ret < 0)
+            return ret;
+        more = fill(cookie, (char *)areas + pcm_frames_to_bytes(mmap->pcm, offset), &frames);
+        ret = pcm_mmap_commit(mmap->pcm, offset, frames);
+        if (ret < 0)
+            return ret;
+
+        if (!mmap->running &&
+                mmap->buffer_frames - (avail - frames) >= mmap->start_threshold) {
+            if (pcm_start(mmap->pcm) != 0)
+                return -EIO;
+            mmap->running = true;
+        }
+    }
+    return 0;
+}
+
+struct mmap_copy {
+    const char *data;
+    unsigned int frames;
+    unsigned int frame_size;
+};
+
+static bool mmap_copy_fill(void *cookie, void *dst, unsigned int *frames)
+{
+    struct mmap_copy *copy = (struct mmap_copy *)cookie;
+
+    if (*frames > copy->frames)
+        *frames = copy->frames;
+    memcpy(dst, copy->data, *frames * copy->frame_size);
+    copy->data += *frames * copy->frame_size;
+    copy->frames -= *frames;
+    return copy->frames > 0;
+}
+
+int audio_mmap_copy(struct audio_mmap *mmap, const void *data, unsigned int frames)
+{
+    struct mmap_copy copy;
+
+    if (frames == 0)
+        return 0;
+    copy.data = (const char *)data;
+    copy.frames = frames;
+    copy.frame_size = pcm_frames_to_bytes(mmap->pcm, 1);
+    return audio_mmap_write(mmap, mmap_copy_fill, &copy);
+}
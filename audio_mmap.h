@@ -0,0 +1,38 @@
+#ifndef __AUDIO_MMAP_H__
+#define __AUDIO_MMAP_H__
+
+#include <stdbool.h>
+#include <tinyalsa/asoundlib.h>
+
+/*
+ * Playback straight into the DMA buffer of a pcm opened with
+ * PCM_MMAP | PCM_NOIRQ. There are no period interrupts, so writers sleep
+ * for the time it takes the hardware to free wake_frames instead.
+ */
+struct audio_mmap {
+    struct pcm *pcm;            /* NULL when the stream is not in mmap mode */
+    unsigned int rate;
+    unsigned int buffer_frames;
+    unsigned int fill_frames;   /* never queue more than this */
+    unsigned int start_threshold;
+    unsigned int wake_frames;
+    bool running;
+};
+
+/*
+ * Produce at most *frames frames at dst, which points into the DMA buffer,
+ * and set *frames to what was written. Return true while there is more.
+ */
+typedef bool (*audio_mmap_fill_t)(void *cookie, void *dst, unsigned int *frames);
+
+void audio_mmap_init(struct audio_mmap *mmap, struct pcm *pcm,
+        const struct pcm_config *config);
+/* queue at most fill_frames, sleeping for wake_frames whenever that is reached */
+void audio_mmap_set_threshold(struct audio_mmap *mmap, unsigned int fill_frames,
+        unsigned int wake_frames);
+/* calls fill until it runs dry, returns 0 or a negative errno */
+int audio_mmap_write(struct audio_mmap *mmap, audio_mmap_fill_t fill, void *cookie);
+/* plain copy of frames already in the device format */
+int audio_mmap_copy(struct audio_mmap *mmap, const void *data, unsigned int frames);
+
+#endif
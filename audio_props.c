@@ -0,0 +1,95 @@
+#define LOG_TAG "audio_props"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "audio_props.h"
+
+#define PROPS_POLL_US 100000
+/*
+ * A slot is rewritten only after PROPS_SLOTS - 1 newer snapshots, so a
+ * reader would have to hold on to one for several poll periods to see it
+ * change under it.
+ */
+#define PROPS_SLOTS 4
+
+static struct audio_props props_slots[PROPS_SLOTS];
+static volatile int32_t props_current;
+static pthread_once_t props_once = PTHREAD_ONCE_INIT;
+
+static bool props_get_bool(const char *key)
+{
+    char buf[PROPERTY_VALUE_MAX];
+
+    if (property_get(key, buf, NULL) > 0)
+        return strcasecmp(buf, "true") == 0 || strcmp(buf, "1") == 0;
+    return false;
+}
+
+static void props_read(struct audio_props *props)
+{
+    char buf[PROPERTY_VALUE_MAX];
+
+    props->multichannel = props_get_bool("ds1.audio.multichannel.support");
+    props->hdmiin_capture = props_get_bool("sys.hdmiIn.Capture");
+    props->wfd = props_get_bool("media.libplayer.wfd");
+    property_get("mbx.hdmiin.vol", buf, "15");
+    props->hdmiin_vol = atoi(buf);
+}
+
+static bool props_equal(const struct audio_props *a, const struct audio_props *b)
+{
+    return a->multichannel == b->multichannel &&
+            a->hdmiin_capture == b->hdmiin_capture &&
+            a->wfd == b->wfd &&
+            a->hdmiin_vol == b->hdmiin_vol;
+}
+
+static void *props_thread(void *arg)
+{
+    struct audio_props next;
+    int32_t current;
+
+    for (;;) {
+        usleep(PROPS_POLL_US);
+        props_read(&next);
+        current = props_current;
+        if (props_equal(&next, &props_slots[current]))
+            continue;
+        current = (current + 1) % PROPS_SLOTS;
+        props_slots[current] = next;
+        android_atomic_release_store(current, &props_current);
+    }
+    return NULL;
+}
+
+static void props_init(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    props_read(&props_slots[0]);
+    android_atomic_release_store(0, &props_current);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, props_thread, NULL) != 0)
+        ALOGW("cannot start property polling, keeping the values read at open");
+    pthread_attr_destroy(&attr);
+}
+
+void audio_props_start(void)
+{
+    pthread_once(&props_once, props_init);
+}
+
+const struct audio_props *audio_props_get(void)
+{
+    return &props_slots[android_atomic_acquire_load(&props_current)];
+}
@@ -0,0 +1,23 @@
+#ifndef __AUDIO_PROPS_H__
+#define __AUDIO_PROPS_H__
+
+#include <stdbool.h>
+
+/*
+ * System properties the audio paths look at on every read or write.
+ * A background thread polls them and publishes a new snapshot when one
+ * changes, so the hot paths pay one atomic load instead of property_get().
+ */
+struct audio_props {
+    bool multichannel;          /* ds1.audio.multichannel.support */
+    bool hdmiin_capture;        /* sys.hdmiIn.Capture */
+    bool wfd;                   /* media.libplayer.wfd */
+    int hdmiin_vol;             /* mbx.hdmiin.vol, 15 when unset */
+};
+
+/* read the properties once and start polling, safe to call repeatedly */
+void audio_props_start(void);
+/* latest snapshot, only valid after audio_props_start() */
+const struct audio_props *audio_props_get(void);
+
+#endif
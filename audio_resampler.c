@@ -1,103 +1,2012 @@
-#include <math.h>
-#include <cutils/log.h>
-
-#include "audio_resampler.h"
-
-#define LOG_TAG "usb_audio_resampler"
-
-//Clip from 16.16 fixed-point to 0.15 fixed-point.
-inline static short clip(int x) {
-    if (x < -32768) {
-        return -32768;
-    } else if (x > 32767) {
-        return 32767;
-    } else {
-        return x;
-    }
-}
-
-int resampler_init(struct resample_para *resample) {
-	
-    ALOGD("%s, Init Resampler: input_sr = %d, output_sr = %d \n",
-		__FUNCTION__,resample->input_sr,resample->output_sr);
-	
-    static const double kPhaseMultiplier = 1L << 28;
-
-    resample->FractionStep = (unsigned int) (resample->input_sr * kPhaseMultiplier 
-							/ resample->output_sr);
-    resample->SampleFraction = 0;
-	resample->lastsample_left = 0;
-	resample->lastsample_right = 0;
-    return 0;
-}
-
-int resample_process(struct resample_para *resample, unsigned int in_frame,
-        short* input, short* output) {
-    unsigned int inputIndex = 0;
-    unsigned int outputIndex = 0;
-    unsigned int FractionStep = resample->FractionStep;
-
-    static const unsigned int kPhaseMask = (1LU << 28) - 1;
-    unsigned int frac = resample->SampleFraction;
-    short lastsample_left = resample->lastsample_left;
-    short lastsample_right = resample->lastsample_right;
-
-	if(resample->channels == 2){
-    	while (inputIndex == 0) {
-        	*output++ = clip((int) lastsample_left + 
-				((((int) input[0] - (int) lastsample_left) * ((int) frac >> 13)) >> 15));
-        	*output++ = clip((int) lastsample_right + 
-				((((int) input[1] - (int) lastsample_right) * ((int) frac >> 13)) >> 15));
-
-        	frac += FractionStep;
-        	inputIndex += (frac >> 28);
-        	frac = (frac & kPhaseMask);
-        	outputIndex++;
-    	}
-
-    	while (inputIndex < in_frame) {
-        	*output++ = clip((int) input[2 * inputIndex - 2] + ((((int) input[2 * inputIndex] 
-				- (int) input[2 * inputIndex - 2]) * ((int) frac >> 13)) >> 15));
-        	*output++ = clip((int) input[2 * inputIndex - 1] + ((((int) input[2 * inputIndex + 1]
-                - (int) input[2 * inputIndex - 1]) * ((int) frac >> 13)) >> 15));
-
-       		frac += FractionStep;
-        	inputIndex += (frac >> 28);
-        	frac = (frac & kPhaseMask);
-        	outputIndex++;
-    	}
-
-    	resample->lastsample_left = input[2 * in_frame - 2];
-    	resample->lastsample_right = input[2 * in_frame - 1];
-    	resample->SampleFraction = frac;
-	}else{
-		//left channel as output
-		while (inputIndex == 0) {
-        	*output++ = clip((int) lastsample_left + 
-				((((int) input[0] - (int) lastsample_left) * ((int) frac >> 13)) >> 15));
-
-        	frac += FractionStep;
-        	inputIndex += (frac >> 28);
-        	frac = (frac & kPhaseMask);
-        	outputIndex++;
-    	}
-
-    	while (inputIndex < in_frame) {
-        	*output++ = clip((int) input[2 * inputIndex - 2] + ((((int) input[2 * inputIndex] 
-				- (int) input[2 * inputIndex - 2]) * ((int) frac >> 13)) >> 15));
-
-       		frac += FractionStep;
-        	inputIndex += (frac >> 28);
-        	frac = (frac & kPhaseMask);
-        	outputIndex++;
-    	}
-
-    	resample->lastsample_left = input[2 * in_frame - 2];
-    	resample->SampleFraction = frac;
-	}
-	
-    return outputIndex;
-}
-
-
-
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef RESAMPLER_HOST_BUILD
+/* standalone builds such as audio_resampler_bench have no liblog */
+#define ALOGD(...) ((void) 0)
+#define ALOGE(...) ((void) 0)
+#else
+#include <cutils/log.h>
+#include <audio_utils/resampler.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define RESAMPLER_NEON 1
+#include <arm_neon.h>
+#endif
+#if defined(__SSE2__)
+#define RESAMPLER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "audio_resampler.h"
+
+#define LOG_TAG "usb_audio_resampler"
+
+static const unsigned int kPhaseMask = (1LU << 28) - 1;
+
+//Clip from 16.16 fixed-point to 0.15 fixed-point.
+inline static short clip(int x) {
+    if (x < -32768) {
+        return -32768;
+    } else if (x > 32767) {
+        return 32767;
+    } else {
+        return x;
+    }
+}
+
+/* weight is the 15-bit position of the output between prev and cur */
+inline static short interp(short prev, short cur, int weight) {
+    return clip((int) prev + ((((int) cur - (int) prev) * weight) >> 15));
+}
+
+/*
+ * Exact L/M conversion for the common rate pairs. The phase is an integer
+ * counter in [0, up) advanced by down per output frame, so nothing drifts
+ * however long the stream runs, and the interpolation weight of each phase
+ * comes from a table built by the preprocessor. Only ratios with
+ * down < up are listed, so an output frame moves at most one input frame.
+ */
+struct resample_ratio {
+    unsigned int input_sr;
+    unsigned int output_sr;
+    unsigned int up;            /* L: output frames per period */
+    unsigned int down;          /* M: input frames per period */
+    const short *weight;        /* Q15 weight of each of the up phases */
+};
+
+#define RATIO_W(p, L)       ((short) (((p) * 32768 + (L) / 2) / (L)))
+#define RATIO_W4(p, L)      RATIO_W(p, L), RATIO_W((p) + 1, L), \
+                            RATIO_W((p) + 2, L), RATIO_W((p) + 3, L)
+#define RATIO_W16(p, L)     RATIO_W4(p, L), RATIO_W4((p) + 4, L), \
+                            RATIO_W4((p) + 8, L), RATIO_W4((p) + 12, L)
+
+static const short kWeight2[] = { RATIO_W(0, 2), RATIO_W(1, 2) };
+static const short kWeight3[] = { RATIO_W(0, 3), RATIO_W(1, 3), RATIO_W(2, 3) };
+static const short kWeight4[] = { RATIO_W4(0, 4) };
+static const short kWeight6[] = { RATIO_W4(0, 6), RATIO_W(4, 6), RATIO_W(5, 6) };
+static const short kWeight160[] = {
+    RATIO_W16(0, 160), RATIO_W16(16, 160), RATIO_W16(32, 160), RATIO_W16(48, 160),
+    RATIO_W16(64, 160), RATIO_W16(80, 160), RATIO_W16(96, 160), RATIO_W16(112, 160),
+    RATIO_W16(128, 160), RATIO_W16(144, 160),
+};
+
+static const struct resample_ratio kRatios[] = {
+    { 44100,  48000, 160, 147, kWeight160 },
+    {  8000,  48000,   6,   1, kWeight6 },
+    { 16000,  48000,   3,   1, kWeight3 },
+    { 48000,  96000,   2,   1, kWeight2 },
+    { 48000, 192000,   4,   1, kWeight4 },
+};
+
+/*
+ * Position of the next output frame: index of the input frame it ends on,
+ * phase inside that frame, and how many frames have been written so far.
+ * The phase is the 4.28 fraction, or the ratio phase counter when an exact
+ * ratio is in use.
+ */
+struct resample_phase {
+    unsigned int index;
+    unsigned int frac;
+    unsigned int out;
+};
+
+inline static void phase_step(struct resample_phase *ph, const struct resample_para *resample) {
+    const struct resample_ratio *ratio = resample->ratio;
+
+    if (ratio != NULL) {
+        ph->frac += ratio->down;
+        while (ph->frac >= ratio->up) {
+            ph->frac -= ratio->up;
+            ph->index++;
+        }
+    } else {
+        ph->frac += resample->FractionStep;
+        ph->index += (ph->frac >> 28);
+        ph->frac &= kPhaseMask;
+    }
+    ph->out++;
+}
+
+inline static int phase_weight(const struct resample_phase *ph,
+        const struct resample_para *resample) {
+    if (resample->ratio != NULL)
+        return resample->ratio->weight[ph->frac];
+    return (int) ph->frac >> 13;
+}
+
+/*
+ * When decimating, the last step of a call can land past the end of the
+ * input. The frames it jumped over are skipped at the start of the next
+ * call, so that chunking never shifts the stream.
+ */
+inline static void phase_save(struct resample_para *resample, const struct resample_phase *ph,
+        unsigned int in_frame) {
+    resample->SampleFraction = ph->frac;
+    resample->SampleSkip = ph->index - in_frame;
+}
+
+/*
+ * Every output frame n of a call ends on input frame
+ * (skip * period + phase + n * step) / period, counted from the start of
+ * that call, and the call stops at the first frame that ends past the
+ * input. With the 4.28
+ * accumulator, period is 1 << 28 and step is FractionStep. With an exact
+ * ratio, they are up and down.
+ */
+static unsigned int phase_out_frames(const struct resample_para *resample,
+        unsigned int in_frame) {
+    uint64_t period = (resample->ratio != NULL) ? resample->ratio->up : (1ULL << 28);
+    uint64_t step = (resample->ratio != NULL) ? resample->ratio->down : resample->FractionStep;
+    uint64_t span = in_frame * period;
+    uint64_t start = resample->SampleSkip * period + resample->SampleFraction;
+
+    if (span <= start)
+        return 0;
+    return (span - start + step - 1) / step;
+}
+
+/* largest input that produces at most out_frame output frames */
+static unsigned int phase_in_frames(const struct resample_para *resample,
+        unsigned int out_frame) {
+    uint64_t period = (resample->ratio != NULL) ? resample->ratio->up : (1ULL << 28);
+    uint64_t step = (resample->ratio != NULL) ? resample->ratio->down : resample->FractionStep;
+
+    return (out_frame * step + resample->SampleSkip * period + resample->SampleFraction) / period;
+}
+
+/*
+ * Phase step and state for input_sr to output_sr, with the exact ratio
+ * when the pair has one.
+ */
+static void phase_init(struct resample_para *resample) {
+    static const double kPhaseMultiplier = 1L << 28;
+    unsigned int i;
+
+    resample->FractionStep = (unsigned int) (resample->input_sr * kPhaseMultiplier
+							/ resample->output_sr);
+    resample->SampleFraction = 0;
+    resample->SampleSkip = 0;
+    memset(resample->lastsample, 0, sizeof(resample->lastsample));
+    memset(&resample->last32, 0, sizeof(resample->last32));
+    resample->ratio = NULL;
+    for (i = 0; i < sizeof(kRatios) / sizeof(kRatios[0]); i++) {
+        if (kRatios[i].input_sr == resample->input_sr &&
+                kRatios[i].output_sr == resample->output_sr) {
+            resample->ratio = &kRatios[i];
+            ALOGD("%s, exact ratio %d/%d", __FUNCTION__, kRatios[i].up, kRatios[i].down);
+            break;
+        }
+    }
+}
+
+/*
+ * Scalar interpolator for any interleaved layout. Each wrapper below passes
+ * a constant channel count so that the per-frame loop is fully unrolled.
+ */
+inline static int resample_linear_c(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output, const unsigned int channels) {
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+    short *lastsample = resample->lastsample;
+    unsigned int c;
+    int w;
+
+    while (ph.index == 0) {
+        w = phase_weight(&ph, resample);
+        for (c = 0; c < channels; c++)
+            *output++ = interp(lastsample[c], input[c], w);
+        phase_step(&ph, resample);
+    }
+
+    while (ph.index < in_frame) {
+        const short *cur = input + channels * ph.index;
+        const short *prev = cur - channels;
+
+        w = phase_weight(&ph, resample);
+        for (c = 0; c < channels; c++)
+            *output++ = interp(prev[c], cur[c], w);
+        phase_step(&ph, resample);
+    }
+
+    for (c = 0; c < channels; c++)
+        lastsample[c] = input[channels * (in_frame - 1) + c];
+    phase_save(resample, &ph, in_frame);
+
+    return ph.out;
+}
+
+static int resample_mono_c(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_linear_c(resample, in_frame, input, output, 1);
+}
+
+static int resample_stereo_c(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_linear_c(resample, in_frame, input, output, 2);
+}
+
+static int resample_5point1_c(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_linear_c(resample, in_frame, input, output, 6);
+}
+
+static int resample_7point1_c(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_linear_c(resample, in_frame, input, output, 8);
+}
+
+static int resample_multi_c(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_linear_c(resample, in_frame, input, output, resample->channels);
+}
+
+#if defined(RESAMPLER_NEON) || defined(RESAMPLER_SSE2)
+/*
+ * Scalar head and tail shared by the vector kernels. The head covers the
+ * frames interpolated against the history sample, the tail the last few
+ * frames that do not fill a whole vector, and stores the history back.
+ */
+static short *stereo_head(struct resample_para *resample, short *input, short *output,
+        struct resample_phase *ph) {
+    while (ph->index == 0) {
+        int w = phase_weight(ph, resample);
+
+        *output++ = interp(resample->lastsample[0], input[0], w);
+        *output++ = interp(resample->lastsample[1], input[1], w);
+        phase_step(ph, resample);
+    }
+    return output;
+}
+
+static int stereo_tail(struct resample_para *resample, unsigned int in_frame,
+        short *input, short *output, struct resample_phase *ph) {
+    while (ph->index < in_frame) {
+        int w = phase_weight(ph, resample);
+
+        *output++ = interp(input[2 * ph->index - 2], input[2 * ph->index], w);
+        *output++ = interp(input[2 * ph->index - 1], input[2 * ph->index + 1], w);
+        phase_step(ph, resample);
+    }
+    resample->lastsample[0] = input[2 * in_frame - 2];
+    resample->lastsample[1] = input[2 * in_frame - 1];
+    phase_save(resample, ph, in_frame);
+    return ph->out;
+}
+
+#ifdef RESAMPLER_NEON
+static short *mono_head(struct resample_para *resample, short *input, short *output,
+        struct resample_phase *ph) {
+    while (ph->index == 0) {
+        int w = phase_weight(ph, resample);
+
+        *output++ = interp(resample->lastsample[0], input[0], w);
+        phase_step(ph, resample);
+    }
+    return output;
+}
+
+static int mono_tail(struct resample_para *resample, unsigned int in_frame,
+        short *input, short *output, struct resample_phase *ph) {
+    while (ph->index < in_frame) {
+        int w = phase_weight(ph, resample);
+
+        *output++ = interp(input[ph->index - 1], input[ph->index], w);
+        phase_step(ph, resample);
+    }
+    resample->lastsample[0] = input[in_frame - 1];
+    phase_save(resample, ph, in_frame);
+    return ph->out;
+}
+#endif
+
+/*
+ * Plans the next n output frames: input index and 15-bit weight of each.
+ * Returns 0 when the last one would run past the input, in which case the
+ * caller falls back to the scalar tail and ph is left untouched.
+ */
+inline static int phase_plan(struct resample_phase *ph, const struct resample_para *resample,
+        unsigned int in_frame, unsigned int *index, int *weight, int n) {
+    struct resample_phase next = *ph;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        index[i] = next.index;
+        weight[i] = phase_weight(&next, resample);
+        phase_step(&next, resample);
+    }
+    if (index[n - 1] >= in_frame)
+        return 0;
+    *ph = next;
+    return 1;
+}
+
+/* two adjacent samples as a single 32-bit word, the first in the low half */
+inline static unsigned int load_frame(const short *p) {
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* (prev, cur) weight pair for madd: prev * -w + cur * w == (cur - prev) * w */
+inline static unsigned int madd_weight(int w) {
+    return ((unsigned int) w << 16) | (unsigned short) -w;
+}
+#endif
+
+#ifdef RESAMPLER_NEON
+static int resample_stereo_neon(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+    unsigned int index[4];
+    int weight[4];
+    unsigned int prev[4], cur[4];
+    int i;
+
+    output = stereo_head(resample, input, output, &ph);
+    while (phase_plan(&ph, resample, in_frame, index, weight, 4)) {
+        for (i = 0; i < 4; i++) {
+            prev[i] = load_frame(input + 2 * index[i] - 2);
+            cur[i] = load_frame(input + 2 * index[i]);
+        }
+        int16x8_t p = vreinterpretq_s16_u32(vld1q_u32(prev));
+        int16x8_t c = vreinterpretq_s16_u32(vld1q_u32(cur));
+        int32x4_t w_lo = { weight[0], weight[0], weight[1], weight[1] };
+        int32x4_t w_hi = { weight[2], weight[2], weight[3], weight[3] };
+        int32x4_t lo = vsubl_s16(vget_low_s16(c), vget_low_s16(p));
+        int32x4_t hi = vsubl_s16(vget_high_s16(c), vget_high_s16(p));
+
+        lo = vaddw_s16(vshrq_n_s32(vmulq_s32(lo, w_lo), 15), vget_low_s16(p));
+        hi = vaddw_s16(vshrq_n_s32(vmulq_s32(hi, w_hi), 15), vget_high_s16(p));
+        vst1q_s16(output, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+        output += 8;
+    }
+    return stereo_tail(resample, in_frame, input, output, &ph);
+}
+
+static int resample_mono_neon(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+    unsigned int index[4];
+    int weight[4];
+    short prev[4], cur[4];
+    int i;
+
+    output = mono_head(resample, input, output, &ph);
+    while (phase_plan(&ph, resample, in_frame, index, weight, 4)) {
+        for (i = 0; i < 4; i++) {
+            prev[i] = input[index[i] - 1];
+            cur[i] = input[index[i]];
+        }
+        int16x4_t p = vld1_s16(prev);
+        int32x4_t d = vsubl_s16(vld1_s16(cur), p);
+
+        d = vaddw_s16(vshrq_n_s32(vmulq_s32(d, vld1q_s32(weight)), 15), p);
+        vst1_s16(output, vqmovn_s32(d));
+        output += 4;
+    }
+    return mono_tail(resample, in_frame, input, output, &ph);
+}
+#endif
+
+#ifdef RESAMPLER_SSE2
+static int resample_stereo_sse2(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+    unsigned int index[4];
+    int weight[4];
+
+    output = stereo_head(resample, input, output, &ph);
+    while (phase_plan(&ph, resample, in_frame, index, weight, 4)) {
+        __m128i p = _mm_setr_epi32(load_frame(input + 2 * index[0] - 2),
+                load_frame(input + 2 * index[1] - 2),
+                load_frame(input + 2 * index[2] - 2),
+                load_frame(input + 2 * index[3] - 2));
+        __m128i c = _mm_setr_epi32(load_frame(input + 2 * index[0]),
+                load_frame(input + 2 * index[1]),
+                load_frame(input + 2 * index[2]),
+                load_frame(input + 2 * index[3]));
+        __m128i w = _mm_setr_epi32(madd_weight(weight[0]), madd_weight(weight[1]),
+                madd_weight(weight[2]), madd_weight(weight[3]));
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(p, c), _mm_unpacklo_epi32(w, w));
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(p, c), _mm_unpackhi_epi32(w, w));
+
+        lo = _mm_add_epi32(_mm_srai_epi32(lo, 15), _mm_srai_epi32(_mm_unpacklo_epi16(p, p), 16));
+        hi = _mm_add_epi32(_mm_srai_epi32(hi, 15), _mm_srai_epi32(_mm_unpackhi_epi16(p, p), 16));
+        _mm_storeu_si128((__m128i *) output, _mm_packs_epi32(lo, hi));
+        output += 8;
+    }
+    return stereo_tail(resample, in_frame, input, output, &ph);
+}
+
+#endif
+
+/*
+ * Polyphase windowed-sinc engine.
+ *
+ * Each table holds (1 << phase_bits) + 1 rows of taps Q30 coefficients, one
+ * row per quantized phase of the 4.28 SampleFraction, so that the last row
+ * (phase == 1.0) is available when rounding up. With an exact ratio the
+ * table instead holds one row per phase of the L/M counter and phase_bits
+ * is 0. Tables depend only on the tier, the cutoff and the phase count, so
+ * they are built once and shared by every resampler that needs the same
+ * conversion.
+ *
+ * The window of output frame n ends on input frame inputIndex, exactly as
+ * the linear interpolator's cur sample, which makes the FIR path
+ * (taps / 2 - 1) input frames later than the linear one.
+ */
+#define FIR_MAX_TAPS        128     /* past it a decimating table loses stopband */
+/*
+ * Q15 rounding alone leaves 64 taps about 80 dB down, short of the high
+ * tier. Q30 taps times 32-bit samples still fit 64 bits at FIR_MAX_TAPS.
+ */
+#define FIR_SHIFT           30
+#define FIR_ONE             (1 << FIR_SHIFT)
+
+struct resample_fir {
+    int taps;
+    int phase_bits;
+    int phases;
+    double cutoff;
+    int refs;
+    struct resample_fir *next;
+    int32_t coefs[];
+};
+
+/*
+ * The band edges are fractions of the lower Nyquist and the sinc is cut
+ * halfway between them, where a Kaiser window puts its -6 dB point. The
+ * cutoff sits just under the Nyquist, so the images and aliases of
+ * passband tones all land beyond the stopband edge. Taps and beta follow
+ * Kaiser's estimate for about 50, 65 and 90 dB of stopband from low to
+ * high. Decimation scales the taps by the ratio to keep the transition
+ * the same width at the output rate.
+ */
+struct resample_tier {
+    int taps;
+    int phase_bits;
+    double passband;    /* passband edge */
+    double stopband;    /* stopband edge */
+    double beta;        /* Kaiser window shape */
+    int hb_pairs;       /* nonzero side taps of a half-band stage, per side */
+    double hb_beta;     /* Kaiser window shape of the half-band stages */
+    double hb_pass;     /* half-band passband edge as a fraction of its lower Nyquist */
+};
+
+static const struct resample_tier kTiers[] = {
+    [RESAMPLE_QUALITY_LOW]    = { 16, 5, 0.78, 1.18, 4.7,  4, 5.0, 0.5 },
+    [RESAMPLE_QUALITY_MEDIUM] = { 32, 7, 0.85, 1.11, 6.2,  6, 7.0, 0.6 },
+    [RESAMPLE_QUALITY_HIGH]   = { 64, 8, 0.89, 1.07, 8.9, 10, 9.0, 0.7 },
+};
+
+static pthread_mutex_t fir_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct resample_fir *fir_tables;
+
+/* zeroth order modified Bessel function of the first kind */
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    int k;
+
+    for (k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static void fir_build_row(int32_t *row, int taps, double phase, double cutoff, double beta) {
+    double h[FIR_MAX_TAPS];
+    double sum = 0, norm = bessel_i0(beta);
+    int half = taps / 2, k, err, peak = 0;
+
+    for (k = 0; k < taps; k++) {
+        double d = k - half + 1 - phase;
+        double x = d / half;
+        double w = (x * x < 1.0) ? bessel_i0(beta * sqrt(1.0 - x * x)) / norm : 0.0;
+        double s = (d == 0.0) ? 1.0 : sin(M_PI * cutoff * d) / (M_PI * cutoff * d);
+
+        h[k] = cutoff * s * w;
+        sum += h[k];
+    }
+    /* unity DC gain per phase, rounding error folded into the largest tap */
+    err = FIR_ONE;
+    for (k = 0; k < taps; k++) {
+        row[k] = (int32_t) lrint(h[k] / sum * FIR_ONE);
+        err -= row[k];
+        if (abs(row[k]) > abs(row[peak]))
+            peak = k;
+    }
+    row[peak] += err;
+}
+
+static const struct resample_fir *fir_get(unsigned int quality, int taps, double cutoff,
+        const struct resample_ratio *ratio) {
+    const struct resample_tier *tier = &kTiers[quality];
+    struct resample_fir *fir;
+    int phase_bits = (ratio != NULL) ? 0 : tier->phase_bits;
+    int phases = (ratio != NULL) ? (int) ratio->up : (1 << phase_bits);
+    int rows = (ratio != NULL) ? phases : phases + 1, i;
+
+    pthread_mutex_lock(&fir_lock);
+    for (fir = fir_tables; fir != NULL; fir = fir->next) {
+        if (fir->taps == taps && fir->phase_bits == phase_bits &&
+                fir->phases == phases && fir->cutoff == cutoff) {
+            fir->refs++;
+            goto exit;
+        }
+    }
+    fir = malloc(sizeof(*fir) + rows * taps * sizeof(int32_t));
+    if (fir == NULL)
+        goto exit;
+    fir->taps = taps;
+    fir->phase_bits = phase_bits;
+    fir->phases = phases;
+    fir->cutoff = cutoff;
+    fir->refs = 1;
+    for (i = 0; i < rows; i++)
+        fir_build_row(fir->coefs + i * fir->taps, fir->taps,
+                (double) i / phases, cutoff, tier->beta);
+    fir->next = fir_tables;
+    fir_tables = fir;
+    ALOGD("%s, built %d taps x %d phases, cutoff %f", __FUNCTION__,
+            fir->taps, rows, cutoff);
+exit:
+    pthread_mutex_unlock(&fir_lock);
+    return fir;
+}
+
+static void fir_put(const struct resample_fir *table) {
+    struct resample_fir **pp;
+
+    pthread_mutex_lock(&fir_lock);
+    for (pp = &fir_tables; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == table) {
+            if (--(*pp)->refs == 0) {
+                struct resample_fir *fir = *pp;
+                *pp = fir->next;
+                free(fir);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fir_lock);
+}
+
+inline static const int32_t *fir_row(const struct resample_fir *fir, unsigned int frac) {
+    int shift = 28 - fir->phase_bits;
+
+    if (fir->phase_bits == 0)
+        return fir->coefs + frac * fir->taps;
+    return fir->coefs + ((frac + (1u << (shift - 1))) >> shift) * fir->taps;
+}
+
+inline static short fir_round(int64_t acc) {
+    return clip((int) ((acc + FIR_ONE / 2) >> FIR_SHIFT));
+}
+
+/*
+ * One output frame from the taps frames starting at src. As for the linear
+ * path the channel count is a constant in the specialized callers.
+ */
+inline static void fir_frame(short *out, const short *src, const int32_t *h, int taps,
+        const unsigned int channels) {
+    int64_t acc[RESAMPLE_MAX_CHANNELS] = { 0 };
+    unsigned int c;
+    int k;
+
+    for (k = 0; k < taps; k++) {
+        for (c = 0; c < channels; c++)
+            acc[c] += (int64_t) h[k] * src[c];
+        src += channels;
+    }
+    for (c = 0; c < channels; c++)
+        out[c] = fir_round(acc[c]);
+}
+
+/*
+ * The history area holds 2 * (taps - 1) frames: the last taps - 1 input
+ * frames, then a copy of the first input frames so that windows
+ * straddling the call boundary are contiguous.
+ */
+inline static int resample_fir_n(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output, const unsigned int channels) {
+    const struct resample_fir *fir = resample->fir;
+    int taps = fir->taps;
+    unsigned int hist = taps - 1;
+    unsigned int head = (in_frame < hist) ? in_frame : hist;
+    short *ext = resample->history;
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+
+    memcpy(ext + hist * channels, input, head * channels * sizeof(short));
+
+    while (ph.index < head) {
+        fir_frame(output, ext + ph.index * channels, fir_row(fir, ph.frac), taps, channels);
+        output += channels;
+        phase_step(&ph, resample);
+    }
+    while (ph.index < in_frame) {
+        fir_frame(output, input + (ph.index - hist) * channels, fir_row(fir, ph.frac),
+                taps, channels);
+        output += channels;
+        phase_step(&ph, resample);
+    }
+
+    if (in_frame >= hist)
+        memcpy(ext, input + (in_frame - hist) * channels, hist * channels * sizeof(short));
+    else
+        memmove(ext, ext + in_frame * channels, hist * channels * sizeof(short));
+    phase_save(resample, &ph, in_frame);
+
+    return ph.out;
+}
+
+static int resample_fir_mono(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_fir_n(resample, in_frame, input, output, 1);
+}
+
+static int resample_fir_stereo(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_fir_n(resample, in_frame, input, output, 2);
+}
+
+static int resample_fir_5point1(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_fir_n(resample, in_frame, input, output, 6);
+}
+
+static int resample_fir_7point1(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_fir_n(resample, in_frame, input, output, 8);
+}
+
+static int resample_fir_multi(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_fir_n(resample, in_frame, input, output, resample->channels);
+}
+
+/* a decimating table spans the tier's taps at the output rate */
+static int fir_taps(const struct resample_para *resample) {
+    int taps = kTiers[resample->quality].taps;
+
+    if (resample->output_sr < resample->input_sr)
+        taps = 2 * (int) (((uint64_t) taps * resample->input_sr / resample->output_sr + 1) / 2);
+    return (taps < FIR_MAX_TAPS) ? taps : FIR_MAX_TAPS;
+}
+
+static double fir_cutoff(const struct resample_para *resample) {
+    const struct resample_tier *tier = &kTiers[resample->quality];
+    double cutoff = (tier->passband + tier->stopband) / 2;
+
+    /* when decimating, the passband has to fit under the output Nyquist */
+    if (resample->output_sr < resample->input_sr)
+        cutoff = cutoff * resample->output_sr / resample->input_sr;
+    return cutoff;
+}
+
+static int fir_init(struct resample_para *resample) {
+    unsigned int hist;
+
+    resample->fir = fir_get(resample->quality, fir_taps(resample), fir_cutoff(resample),
+            resample->ratio);
+    if (resample->fir == NULL)
+        return -ENOMEM;
+    hist = resample->fir->taps - 1;
+    resample->history = calloc(2 * hist * resample->channels,
+            (resample->format == RESAMPLE_FORMAT_S16) ? sizeof(short) : sizeof(int32_t));
+    if (resample->history == NULL) {
+        fir_put(resample->fir);
+        resample->fir = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * 24-bit, 32-bit and float samples. They follow the same phase and
+ * coefficient tables as the 16-bit path, but interpolate and accumulate at
+ * full sample width (64-bit integers or float) so nothing is truncated to
+ * 16 bits on the way. S24 is tinyalsa's S24_LE: 24 bits sign extended from
+ * the low three bytes of each 32-bit word. There are no vector kernels for
+ * these formats.
+ */
+inline static int32_t load_wide(const int32_t *p, const unsigned int format) {
+    if (format == RESAMPLE_FORMAT_S24)
+        return (int32_t) ((uint32_t) *p << 8) >> 8;
+    return *p;
+}
+
+inline static int32_t clip_wide(int64_t x, const unsigned int format) {
+    const int64_t max = (format == RESAMPLE_FORMAT_S24) ? 0x7fffff : 0x7fffffff;
+
+    if (x < -max - 1)
+        return -max - 1;
+    else if (x > max)
+        return max;
+    return x;
+}
+
+inline static int resample_linear_i32(struct resample_para *resample, unsigned int in_frame,
+        const int32_t *input, int32_t *output, const unsigned int channels,
+        const unsigned int format) {
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+    int32_t *last = resample->last32.i;
+    unsigned int c;
+    int w;
+
+    while (ph.index == 0) {
+        w = phase_weight(&ph, resample);
+        for (c = 0; c < channels; c++) {
+            int64_t cur = load_wide(input + c, format);
+            *output++ = clip_wide(last[c] + (((cur - last[c]) * w) >> 15), format);
+        }
+        phase_step(&ph, resample);
+    }
+
+    while (ph.index < in_frame) {
+        const int32_t *cur = input + channels * ph.index;
+        const int32_t *prev = cur - channels;
+
+        w = phase_weight(&ph, resample);
+        for (c = 0; c < channels; c++) {
+            int64_t p = load_wide(prev + c, format);
+            *output++ = clip_wide(p + (((load_wide(cur + c, format) - p) * w) >> 15), format);
+        }
+        phase_step(&ph, resample);
+    }
+
+    for (c = 0; c < channels; c++)
+        last[c] = load_wide(input + channels * (in_frame - 1) + c, format);
+    phase_save(resample, &ph, in_frame);
+
+    return ph.out;
+}
+
+inline static int resample_linear_float(struct resample_para *resample, unsigned int in_frame,
+        const float *input, float *output, const unsigned int channels) {
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+    float *last = resample->last32.f;
+    unsigned int c;
+    float w;
+
+    while (ph.index == 0) {
+        w = phase_weight(&ph, resample) * (1.0f / 32768);
+        for (c = 0; c < channels; c++)
+            *output++ = last[c] + (input[c] - last[c]) * w;
+        phase_step(&ph, resample);
+    }
+
+    while (ph.index < in_frame) {
+        const float *cur = input + channels * ph.index;
+        const float *prev = cur - channels;
+
+        w = phase_weight(&ph, resample) * (1.0f / 32768);
+        for (c = 0; c < channels; c++)
+            *output++ = prev[c] + (cur[c] - prev[c]) * w;
+        phase_step(&ph, resample);
+    }
+
+    for (c = 0; c < channels; c++)
+        last[c] = input[channels * (in_frame - 1) + c];
+    phase_save(resample, &ph, in_frame);
+
+    return ph.out;
+}
+
+/* same history layout as resample_fir_n(), in 32-bit words */
+inline static int resample_fir_i32(struct resample_para *resample, unsigned int in_frame,
+        const int32_t *input, int32_t *output, const unsigned int channels,
+        const unsigned int format) {
+    const struct resample_fir *fir = resample->fir;
+    int taps = fir->taps;
+    unsigned int hist = taps - 1;
+    unsigned int head = (in_frame < hist) ? in_frame : hist;
+    int32_t *ext = resample->history;
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+    unsigned int c;
+    int k;
+
+    for (c = 0; c < head * channels; c++)
+        ext[hist * channels + c] = load_wide(input + c, format);
+
+    while (ph.index < in_frame) {
+        const int32_t *h = fir_row(fir, ph.frac);
+        int64_t acc[RESAMPLE_MAX_CHANNELS] = { 0 };
+
+        if (ph.index < head) {
+            const int32_t *src = ext + ph.index * channels;
+            for (k = 0; k < taps; k++, src += channels)
+                for (c = 0; c < channels; c++)
+                    acc[c] += (int64_t) h[k] * src[c];
+        } else {
+            const int32_t *src = input + (ph.index - hist) * channels;
+            for (k = 0; k < taps; k++, src += channels)
+                for (c = 0; c < channels; c++)
+                    acc[c] += (int64_t) h[k] * load_wide(src + c, format);
+        }
+        for (c = 0; c < channels; c++)
+            *output++ = clip_wide((acc[c] + FIR_ONE / 2) >> FIR_SHIFT, format);
+        phase_step(&ph, resample);
+    }
+
+    if (in_frame >= hist) {
+        for (c = 0; c < hist * channels; c++)
+            ext[c] = load_wide(input + (in_frame - hist) * channels + c, format);
+    } else {
+        memmove(ext, ext + in_frame * channels, hist * channels * sizeof(int32_t));
+    }
+    phase_save(resample, &ph, in_frame);
+
+    return ph.out;
+}
+
+inline static int resample_fir_float(struct resample_para *resample, unsigned int in_frame,
+        const float *input, float *output, const unsigned int channels) {
+    const struct resample_fir *fir = resample->fir;
+    int taps = fir->taps;
+    unsigned int hist = taps - 1;
+    unsigned int head = (in_frame < hist) ? in_frame : hist;
+    float *ext = resample->history;
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+    unsigned int c;
+    int k;
+
+    memcpy(ext + hist * channels, input, head * channels * sizeof(float));
+
+    while (ph.index < in_frame) {
+        const int32_t *h = fir_row(fir, ph.frac);
+        const float *src = (ph.index < head) ? ext + ph.index * channels
+                : input + (ph.index - hist) * channels;
+        float acc[RESAMPLE_MAX_CHANNELS] = { 0 };
+
+        for (k = 0; k < taps; k++, src += channels)
+            for (c = 0; c < channels; c++)
+                acc[c] += h[k] * src[c];
+        for (c = 0; c < channels; c++)
+            *output++ = acc[c] * (1.0f / FIR_ONE);
+        phase_step(&ph, resample);
+    }
+
+    if (in_frame >= hist)
+        memcpy(ext, input + (in_frame - hist) * channels, hist * channels * sizeof(float));
+    else
+        memmove(ext, ext + in_frame * channels, hist * channels * sizeof(float));
+    phase_save(resample, &ph, in_frame);
+
+    return ph.out;
+}
+
+inline static int resample_i32(struct resample_para *resample, unsigned int in_frame,
+        const int32_t *input, int32_t *output, const unsigned int channels,
+        const unsigned int format) {
+    if (resample->fir != NULL)
+        return resample_fir_i32(resample, in_frame, input, output, channels, format);
+    return resample_linear_i32(resample, in_frame, input, output, channels, format);
+}
+
+inline static int resample_float(struct resample_para *resample, unsigned int in_frame,
+        const float *input, float *output, const unsigned int channels) {
+    if (resample->fir != NULL)
+        return resample_fir_float(resample, in_frame, input, output, channels);
+    return resample_linear_float(resample, in_frame, input, output, channels);
+}
+
+/*
+ * CPU feature probes. A build that already targets NEON needs no probe;
+ * otherwise /proc/cpuinfo is parsed once per process, not per stream.
+ */
+#ifdef RESAMPLER_NEON
+#if !defined(__aarch64__) && !defined(__ARM_NEON__) && !defined(__ARM_NEON)
+static pthread_once_t neon_once = PTHREAD_ONCE_INIT;
+static int neon_found;
+
+static void probe_neon(void) {
+    char line[512];
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+
+    if (fp == NULL)
+        return;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "Features", 8) == 0 && strstr(line, " neon") != NULL) {
+            neon_found = 1;
+            break;
+        }
+    }
+    fclose(fp);
+}
+#endif
+
+static int cpu_has_neon(void) {
+#if defined(__aarch64__) || defined(__ARM_NEON__) || defined(__ARM_NEON)
+    return 1;
+#else
+    pthread_once(&neon_once, probe_neon);
+    return neon_found;
+#endif
+}
+#endif
+
+/*
+ * Linear S16 kernels, fastest first for each channel count as measured by
+ * audio_resampler_bench; the first usable entry is always the one picked,
+ * so a kernel that loses to an unprobed one before it has no place here.
+ * channels 0 matches any count, probe is NULL when the kernel runs on
+ * every CPU the build targets.
+ */
+struct resample_kernel_desc {
+    const char *name;
+    unsigned int channels;
+    resample_kernel_t kernel;
+    int (*probe)(void);
+};
+
+static const struct resample_kernel_desc kKernels[] = {
+#ifdef RESAMPLER_SSE2
+    { "sse2", 2, resample_stereo_sse2, NULL },
+#endif
+#ifdef RESAMPLER_NEON
+    { "neon", 1, resample_mono_neon, cpu_has_neon },
+    { "neon", 2, resample_stereo_neon, cpu_has_neon },
+#endif
+    { "c", 1, resample_mono_c, NULL },
+    { "c", 2, resample_stereo_c, NULL },
+    { "c", 6, resample_5point1_c, NULL },
+    { "c", 8, resample_7point1_c, NULL },
+    { "c", 0, resample_multi_c, NULL },
+};
+
+/* first usable kernel for channels, restricted to name unless it is NULL */
+static resample_kernel_t select_kernel(unsigned int channels, const char *name) {
+    unsigned int i;
+
+    for (i = 0; i < sizeof(kKernels) / sizeof(kKernels[0]); i++) {
+        const struct resample_kernel_desc *k = &kKernels[i];
+
+        if (k->channels != 0 && k->channels != channels)
+            continue;
+        if (name != NULL && strcmp(name, k->name))
+            continue;
+        if (k->probe == NULL || k->probe())
+            return k->kernel;
+    }
+    return NULL;
+}
+
+static resample_kernel_t select_fir_kernel(unsigned int channels) {
+    switch (channels) {
+    case 1:
+        return resample_fir_mono;
+    case 2:
+        return resample_fir_stereo;
+    case 6:
+        return resample_fir_5point1;
+    case 8:
+        return resample_fir_7point1;
+    default:
+        return resample_fir_multi;
+    }
+}
+
+/*
+ * Cascade for large ratios: power-of-two half-band stages at the high rate
+ * and one polyphase stage for the remaining fractional ratio at the low
+ * end, i.e. decimate then convert when going down, convert then
+ * interpolate when going up. Half of a half-band's taps are zero and the
+ * rest are symmetric, so a stage costs hb_pairs multiplies per frame of
+ * its lower rate. The chain is only used for S16.
+ */
+#define CASCADE_MAX_STAGES  4
+#define CASCADE_BLOCK       256
+#define HALFBAND_MAX_PAIRS  16
+
+struct resample_halfband {
+    int pairs;
+    /* decimation: 1 when an input frame is waiting for its pair */
+    unsigned int phase;
+    /* Q15 odd taps, nearest the center first; they sum to 0.5 */
+    short coefs[HALFBAND_MAX_PAIRS];
+    /* history followed by the block being filtered */
+    short *work;
+};
+
+struct resample_cascade {
+    int decimate;
+    int stages;
+    struct resample_halfband hb[CASCADE_MAX_STAGES];
+    /* fractional stage, between input_sr or output_sr and the half-band rate */
+    struct resample_para frac;
+    struct resample_ratio ratio;
+    short *scratch;
+};
+
+/*
+ * Decimation by two. The window covers 4 * pairs - 1 input frames and an
+ * output is written each time the newest frame completes a pair, its
+ * center 2 * pairs - 1 frames back.
+ */
+static unsigned int halfband_decimate(struct resample_halfband *hb, const short *input,
+        unsigned int in_frame, short *output, unsigned int channels) {
+    unsigned int hist = 4 * hb->pairs - 2, center = 2 * hb->pairs - 1, i, out = 0;
+    short *w = hb->work;
+    int c, k, ch = channels;
+
+    memcpy(w + hist * channels, input, in_frame * channels * sizeof(short));
+    for (i = 1 - hb->phase; i < in_frame; i += 2) {
+        const short *s = w + (i + center) * channels;
+
+        for (c = 0; c < ch; c++) {
+            /* the taps sum to more than one in magnitude, full scale overflows 32 bits */
+            int64_t acc = (int64_t) s[c] * (1 << 15);
+
+            for (k = 0; k < hb->pairs; k++)
+                acc += hb->coefs[k] * (s[c - (2 * k + 1) * ch] + s[c + (2 * k + 1) * ch]);
+            output[c] = clip((int) ((acc + (1 << 15)) >> 16));
+        }
+        output += channels;
+        out++;
+    }
+    hb->phase = (hb->phase + in_frame) & 1;
+    memmove(w, w + in_frame * channels, hist * channels * sizeof(short));
+    return out;
+}
+
+/*
+ * Interpolation by two. Each input frame writes the frame pairs frames
+ * back unchanged, then the point halfway to the next one from the 2 * pairs
+ * frames around it.
+ */
+static unsigned int halfband_interpolate(struct resample_halfband *hb, const short *input,
+        unsigned int in_frame, short *output, unsigned int channels) {
+    unsigned int hist = 2 * hb->pairs - 1, i;
+    short *w = hb->work;
+    int c, k, ch = channels;
+
+    memcpy(w + hist * channels, input, in_frame * channels * sizeof(short));
+    for (i = 0; i < in_frame; i++) {
+        const short *s = w + (i + hb->pairs - 1) * channels;
+
+        for (c = 0; c < ch; c++) {
+            int64_t acc = 0;
+
+            for (k = 0; k < hb->pairs; k++)
+                acc += hb->coefs[k] * (s[c - k * ch] + s[c + (k + 1) * ch]);
+            output[c] = s[c];
+            output[ch + c] = clip((int) ((acc + (1 << 14)) >> 15));
+        }
+        output += 2 * channels;
+    }
+    memmove(w, w + in_frame * channels, hist * channels * sizeof(short));
+    return 2 * in_frame;
+}
+
+static void halfband_build(struct resample_halfband *hb, int pairs, double beta) {
+    double g[HALFBAND_MAX_PAIRS], sum = 0, norm = bessel_i0(beta);
+    int k, err = 16384;
+
+    hb->pairs = pairs;
+    for (k = 0; k < pairs; k++) {
+        double n = 2 * k + 1, x = n / (2 * pairs);
+
+        g[k] = ((k & 1) ? -2 : 2) / (M_PI * n) * bessel_i0(beta * sqrt(1.0 - x * x)) / norm;
+        sum += g[k];
+    }
+    for (k = 0; k < pairs; k++) {
+        hb->coefs[k] = (short) lrint(g[k] / sum * 16384.0);
+        err -= hb->coefs[k];
+    }
+    hb->coefs[0] += err;
+}
+
+/*
+ * Picks the number of half-band stages with the fewest multiplies per input
+ * frame, 0 when one polyphase stage is cheapest. A half-band may only run
+ * where the tier's passband still fits under its hb_pass edge, and the
+ * fractional stage never changes the rate the other way. A decimating
+ * polyphase stage costs taps times its ratio, see fir_taps(); past
+ * FIR_MAX_TAPS it is cheaper than that but loses stopband instead.
+ */
+static int cascade_plan(const struct resample_para *resample, unsigned int *mid_sr) {
+    const struct resample_tier *tier = &kTiers[resample->quality];
+    unsigned int in = resample->input_sr, out = resample->output_sr;
+    unsigned int high = (in > out) ? in : out, low = (in > out) ? out : in;
+    double edge = tier->passband * low / tier->hb_pass;
+    uint64_t best = (uint64_t) tier->taps * high, cost, hb = 0;
+    int stages, chosen = 0;
+
+    for (stages = 1; stages <= CASCADE_MAX_STAGES; stages++) {
+        unsigned int mid = high >> stages;
+
+        if (high % (1u << stages) != 0 || mid < low || mid < edge)
+            break;
+        hb += (uint64_t) tier->hb_pairs * mid;
+        cost = (uint64_t) tier->taps * mid + hb;
+        if (cost < best) {
+            best = cost;
+            chosen = stages;
+            *mid_sr = mid;
+        }
+    }
+    return chosen;
+}
+
+static void cascade_release(struct resample_cascade *cs) {
+    int i;
+
+    for (i = 0; i < cs->stages; i++)
+        free(cs->hb[i].work);
+    free(cs->scratch);
+    resampler_release(&cs->frac);
+    free(cs);
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while (b != 0) {
+        unsigned int t = a % b;
+
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static int cascade_init(struct resample_para *resample, int stages, unsigned int mid_sr) {
+    const struct resample_tier *tier = &kTiers[resample->quality];
+    struct resample_cascade *cs;
+    struct resample_para *frac;
+    unsigned int channels = resample->channels, block, hist, i;
+
+    cs = calloc(1, sizeof(*cs));
+    if (cs == NULL)
+        return -ENOMEM;
+    cs->decimate = resample->input_sr > resample->output_sr;
+    frac = &cs->frac;
+    frac->input_sr = cs->decimate ? mid_sr : resample->input_sr;
+    frac->output_sr = cs->decimate ? resample->output_sr : mid_sr;
+    frac->channels = channels;
+    frac->in_channels = channels;
+    frac->quality = resample->quality;
+    frac->format = RESAMPLE_FORMAT_S16;
+    phase_init(frac);
+    /*
+     * The rates around a half-band stage are usually small multiples, so the
+     * fractional stage can step exactly. Its ratio has no linear weights and
+     * may decimate, which only the FIR kernels allow.
+     */
+    if (frac->ratio == NULL) {
+        unsigned int g = gcd(frac->input_sr, frac->output_sr);
+
+        cs->ratio.input_sr = frac->input_sr;
+        cs->ratio.output_sr = frac->output_sr;
+        cs->ratio.up = frac->output_sr / g;
+        cs->ratio.down = frac->input_sr / g;
+        if (cs->ratio.up <= 256)
+            frac->ratio = &cs->ratio;
+    }
+    if (fir_init(frac) != 0) {
+        free(cs);
+        return -ENOMEM;
+    }
+    frac->kernel = select_fir_kernel(channels);
+
+    /* largest block each half-band sees, and the scratch between stages */
+    if (cs->decimate)
+        block = CASCADE_BLOCK;
+    else
+        block = (CASCADE_BLOCK * (uint64_t) mid_sr + resample->input_sr - 1) /
+                resample->input_sr + 2;
+    cs->scratch = malloc((block << (cs->decimate ? 0 : stages - 1)) * channels *
+            sizeof(short));
+    if (cs->scratch == NULL)
+        goto fail;
+    for (i = 0; i < (unsigned int) stages; i++) {
+        struct resample_halfband *hb = &cs->hb[i];
+
+        halfband_build(hb, tier->hb_pairs, tier->hb_beta);
+        hist = cs->decimate ? 4 * hb->pairs - 2 : 2 * hb->pairs - 1;
+        hb->work = calloc((hist + (cs->decimate ? block : block << i)) * channels,
+                sizeof(short));
+        cs->stages = i + 1;
+        if (hb->work == NULL)
+            goto fail;
+    }
+    resample->cascade = cs;
+    ALOGD("%s, %d half-band stages, fractional stage %d -> %d", __FUNCTION__,
+            stages, frac->input_sr, frac->output_sr);
+    return 0;
+fail:
+    cascade_release(cs);
+    return -ENOMEM;
+}
+
+static int resample_cascade(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    struct resample_cascade *cs = resample->cascade;
+    unsigned int channels = resample->channels;
+    int out = 0, i;
+
+    while (in_frame > 0) {
+        unsigned int n = (in_frame < CASCADE_BLOCK) ? in_frame : CASCADE_BLOCK;
+        unsigned int count = n;
+        short *src = input;
+
+        if (cs->decimate) {
+            for (i = 0; i < cs->stages; i++) {
+                count = halfband_decimate(&cs->hb[i], src, count, cs->scratch, channels);
+                src = cs->scratch;
+            }
+            out += cs->frac.kernel(&cs->frac, count, src, output + out * channels);
+        } else {
+            count = cs->frac.kernel(&cs->frac, n, input, cs->scratch);
+            for (i = 0; i < cs->stages; i++) {
+                short *dst = (i == cs->stages - 1) ? output + out * channels : cs->scratch;
+
+                count = halfband_interpolate(&cs->hb[i], cs->scratch, count, dst, channels);
+            }
+            out += count;
+        }
+        input += n * channels;
+        in_frame -= n;
+    }
+    return out;
+}
+
+/* the half-band stages write (phase + n) / 2 or 2 * n frames for n */
+static unsigned int cascade_out_frames(const struct resample_cascade *cs,
+        unsigned int in_frame) {
+    int i;
+
+    if (!cs->decimate)
+        return phase_out_frames(&cs->frac, in_frame) << cs->stages;
+    for (i = 0; i < cs->stages; i++)
+        in_frame = (cs->hb[i].phase + in_frame) / 2;
+    return phase_out_frames(&cs->frac, in_frame);
+}
+
+static unsigned int cascade_in_frames(const struct resample_cascade *cs,
+        unsigned int out_frame) {
+    unsigned int n;
+    int i;
+
+    if (!cs->decimate)
+        return phase_in_frames(&cs->frac, out_frame >> cs->stages);
+    n = phase_in_frames(&cs->frac, out_frame);
+    for (i = cs->stages - 1; i >= 0; i--)
+        n = 2 * n + 1 - cs->hb[i].phase;
+    return n;
+}
+
+/*
+ * Fused channel map, gain and resample. Each input frame is mixed into the
+ * output layout once, when the phase first reaches it, and the two mixed
+ * frames around the phase are kept for the interpolation. The result is the
+ * same as mixing the whole buffer first and resampling that, without the
+ * intermediate pass over memory.
+ */
+inline static void mix_frame(short *dst, const short *src, const short *mix,
+        const unsigned int in_channels, const unsigned int channels) {
+    unsigned int c, k;
+
+    for (c = 0; c < channels; c++) {
+        int acc = 0;
+
+        for (k = 0; k < in_channels; k++)
+            acc += mix[c * in_channels + k] * src[k];
+        dst[c] = clip((acc + (1 << 13)) >> 14);
+    }
+}
+
+inline static int resample_mix_n(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output, const unsigned int in_channels,
+        const unsigned int channels) {
+    struct resample_phase ph = { resample->SampleSkip, resample->SampleFraction, 0 };
+    short prev[RESAMPLE_MAX_CHANNELS], cur[RESAMPLE_MAX_CHANNELS];
+    unsigned int mixed = 0, c;
+    int w;
+
+    if (in_frame == 0)
+        return 0;
+    for (c = 0; c < channels; c++)
+        prev[c] = resample->lastsample[c];
+    mix_frame(cur, input, resample->mix, in_channels, channels);
+
+    while (ph.index < in_frame) {
+        if (ph.index != mixed) {
+            if (ph.index == mixed + 1) {
+                for (c = 0; c < channels; c++)
+                    prev[c] = cur[c];
+            } else {
+                mix_frame(prev, input + (ph.index - 1) * in_channels, resample->mix,
+                        in_channels, channels);
+            }
+            mix_frame(cur, input + ph.index * in_channels, resample->mix,
+                    in_channels, channels);
+            mixed = ph.index;
+        }
+        w = phase_weight(&ph, resample);
+        for (c = 0; c < channels; c++)
+            *output++ = interp(prev[c], cur[c], w);
+        phase_step(&ph, resample);
+    }
+
+    if (mixed == in_frame - 1) {
+        for (c = 0; c < channels; c++)
+            resample->lastsample[c] = cur[c];
+    } else {
+        mix_frame(resample->lastsample, input + (in_frame - 1) * in_channels, resample->mix,
+                in_channels, channels);
+    }
+    phase_save(resample, &ph, in_frame);
+
+    return ph.out;
+}
+
+static int resample_mix_stereo_to_mono(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_mix_n(resample, in_frame, input, output, 2, 1);
+}
+
+static int resample_mix_stereo(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_mix_n(resample, in_frame, input, output, 2, 2);
+}
+
+static int resample_mix_multi(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    return resample_mix_n(resample, in_frame, input, output, resample->in_channels,
+            resample->channels);
+}
+
+/*
+ * The FIR reads every frame taps times, so mixing on the fly would repeat
+ * the mix as often. Blocks of input are mixed once into a stack buffer and
+ * handed to the plain FIR kernel instead.
+ */
+static int resample_fir_mix(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    enum { BLOCK = 256 };
+    short block[BLOCK * RESAMPLE_MAX_CHANNELS];
+    resample_kernel_t fir = (resample->cascade != NULL) ?
+            resample_cascade : select_fir_kernel(resample->channels);
+    unsigned int in_channels = resample->in_channels, channels = resample->channels, i;
+    int out = 0;
+
+    while (in_frame > 0) {
+        unsigned int n = (in_frame < BLOCK) ? in_frame : BLOCK;
+
+        for (i = 0; i < n; i++)
+            mix_frame(block + i * channels, input + i * in_channels, resample->mix,
+                    in_channels, channels);
+        out += fir(resample, n, block, output + out * channels);
+        input += n * in_channels;
+        in_frame -= n;
+    }
+    return out;
+}
+
+static int mix_is_identity(const struct resample_para *resample) {
+    unsigned int n = resample->channels, i;
+
+    if (resample->in_channels != n)
+        return 0;
+    for (i = 0; i < n * n; i++) {
+        if (resample->mix[i] != ((i % (n + 1) == 0) ? (1 << 14) : 0))
+            return 0;
+    }
+    return 1;
+}
+
+int resampler_set_mix(struct resample_para *resample, unsigned int in_channels,
+        const float *matrix, float gain) {
+    unsigned int i;
+
+    if (in_channels == 0 || in_channels > RESAMPLE_MAX_CHANNELS ||
+            resample->format != RESAMPLE_FORMAT_S16)
+        return -EINVAL;
+    for (i = 0; i < in_channels * resample->channels; i++) {
+        float v = matrix[i] * gain * (1 << 14);
+
+        if (v > 32767 || v < -32768)
+            return -EINVAL;
+        resample->mix[i] = lrintf(v);
+    }
+    resample->in_channels = in_channels;
+
+    /* an identity mix at unity, such as a volume ramp that ended, costs nothing */
+    if (mix_is_identity(resample)) {
+        if (resample->cascade != NULL)
+            resample->kernel = resample_cascade;
+        else if (resample->fir != NULL)
+            resample->kernel = select_fir_kernel(resample->channels);
+        else
+            resample->kernel = select_kernel(resample->channels, NULL);
+    } else if (resample->fir != NULL || resample->cascade != NULL)
+        resample->kernel = resample_fir_mix;
+    else if (in_channels == 2 && resample->channels == 1)
+        resample->kernel = resample_mix_stereo_to_mono;
+    else if (in_channels == 2 && resample->channels == 2)
+        resample->kernel = resample_mix_stereo;
+    else
+        resample->kernel = resample_mix_multi;
+    return 0;
+}
+
+int resampler_init(struct resample_para *resample) {
+
+    unsigned int mid_sr = 0;
+    int stages;
+
+    ALOGD("%s, Init Resampler: input_sr = %d, output_sr = %d, quality = %d \n",
+		__FUNCTION__,resample->input_sr,resample->output_sr,resample->quality);
+
+    phase_init(resample);
+    resample->fir = NULL;
+    resample->history = NULL;
+    resample->cascade = NULL;
+    resample->in_channels = resample->channels;
+
+    if (resample->channels == 0 || resample->channels > RESAMPLE_MAX_CHANNELS) {
+        ALOGE("%s, unsupported channel count %d", __FUNCTION__, resample->channels);
+        return -EINVAL;
+    }
+    if (resample->format > RESAMPLE_FORMAT_FLOAT) {
+        ALOGE("%s, unsupported format %d", __FUNCTION__, resample->format);
+        return -EINVAL;
+    }
+
+    if (resample->quality > RESAMPLE_QUALITY_HIGH)
+        resample->quality = RESAMPLE_QUALITY_HIGH;
+    if (resample->quality != RESAMPLE_QUALITY_LINEAR) {
+        stages = (resample->format == RESAMPLE_FORMAT_S16) ?
+                cascade_plan(resample, &mid_sr) : 0;
+        if (stages > 0 && cascade_init(resample, stages, mid_sr) == 0) {
+            resample->kernel = resample_cascade;
+            return 0;
+        }
+        if (fir_init(resample) == 0) {
+            resample->kernel = select_fir_kernel(resample->channels);
+            return 0;
+        }
+        ALOGE("%s, no memory for FIR tables, falling back to linear", __FUNCTION__);
+        resample->quality = RESAMPLE_QUALITY_LINEAR;
+    }
+    resample->kernel = select_kernel(resample->channels, NULL);
+    return 0;
+}
+
+int resampler_set_kernel(struct resample_para *resample, const char *name) {
+    resample_kernel_t kernel;
+
+    if (resample->fir != NULL || resample->cascade != NULL ||
+            resample->in_channels != resample->channels)
+        return -EINVAL;
+    kernel = select_kernel(resample->channels, name);
+    if (kernel == NULL)
+        return -ENOSYS;
+    resample->kernel = kernel;
+    return 0;
+}
+
+const char *resampler_kernel_name(const struct resample_para *resample) {
+    unsigned int i;
+
+    if (resample->cascade != NULL)
+        return "cascade";
+    if (resample->fir != NULL)
+        return "fir";
+    for (i = 0; i < sizeof(kKernels) / sizeof(kKernels[0]); i++) {
+        if (kKernels[i].kernel == resample->kernel)
+            return kKernels[i].name;
+    }
+    return "unknown";
+}
+
+void resampler_release(struct resample_para *resample) {
+    if (resample->cascade != NULL) {
+        cascade_release(resample->cascade);
+        resample->cascade = NULL;
+    }
+    if (resample->fir != NULL) {
+        fir_put(resample->fir);
+        resample->fir = NULL;
+    }
+    free(resample->history);
+    resample->history = NULL;
+}
+
+double resampler_passband(int quality) {
+    if (quality <= RESAMPLE_QUALITY_LINEAR)
+        return 0;
+    if (quality > RESAMPLE_QUALITY_HIGH)
+        quality = RESAMPLE_QUALITY_HIGH;
+    return kTiers[quality].passband;
+}
+
+double resampler_stopband(int quality) {
+    if (quality <= RESAMPLE_QUALITY_LINEAR)
+        return 0;
+    if (quality > RESAMPLE_QUALITY_HIGH)
+        quality = RESAMPLE_QUALITY_HIGH;
+    return kTiers[quality].stopband;
+}
+
+int resampler_quality_from_string(const char *name) {
+    if (name == NULL)
+        return RESAMPLE_QUALITY_LINEAR;
+    if (!strcmp(name, "low"))
+        return RESAMPLE_QUALITY_LOW;
+    if (!strcmp(name, "medium"))
+        return RESAMPLE_QUALITY_MEDIUM;
+    if (!strcmp(name, "high"))
+        return RESAMPLE_QUALITY_HIGH;
+    return RESAMPLE_QUALITY_LINEAR;
+}
+
+unsigned int resample_out_frames(const struct resample_para *resample, unsigned int in_frame) {
+    if (resample->cascade != NULL)
+        return cascade_out_frames(resample->cascade, in_frame);
+    return phase_out_frames(resample, in_frame);
+}
+
+static unsigned int resample_in_frames(const struct resample_para *resample,
+        unsigned int out_frame) {
+    if (resample->cascade != NULL)
+        return cascade_in_frames(resample->cascade, out_frame);
+    return phase_in_frames(resample, out_frame);
+}
+
+/*
+ * How far the signal in the next output frame lies behind the last input
+ * frame passed in, in input frames. The window of that output ends on
+ * input frame skip of the next call, and its center sits taps / 2 (1 for
+ * linear) minus the phase before that, so the delay is
+ * taps / 2 - phase - skip - 1. Linear output runs ahead of the input by
+ * up to a frame, so the delay can be negative. A decimating half-band
+ * stage adds 2 * pairs - 1 input frames plus the one it may be holding.
+ * An interpolating one adds pairs frames of its input rate.
+ */
+static double resample_delay_frames(const struct resample_para *resample) {
+    const struct resample_cascade *cs = resample->cascade;
+    double half = (resample->fir != NULL) ? resample->fir->taps / 2 : 1;
+    double frac = (resample->ratio != NULL) ?
+            (double) resample->SampleFraction / resample->ratio->up :
+            (double) resample->SampleFraction / (1 << 28);
+    double delay = 0, scale = 1;
+    int i;
+
+    if (cs == NULL)
+        return half - frac - resample->SampleSkip - 1;
+    if (cs->decimate) {
+        for (i = 0; i < cs->stages; i++) {
+            delay += (2 * cs->hb[i].pairs - 1 + cs->hb[i].phase) * scale;
+            scale *= 2;
+        }
+        return delay + resample_delay_frames(&cs->frac) * scale;
+    }
+    delay = resample_delay_frames(&cs->frac);
+    scale = (double) cs->frac.input_sr / cs->frac.output_sr;
+    for (i = 0; i < cs->stages; i++) {
+        delay += cs->hb[i].pairs * scale;
+        scale /= 2;
+    }
+    return delay;
+}
+
+void resample_delay(const struct resample_para *resample, int *frames,
+        unsigned int *fraction) {
+    double delay = resample_delay_frames(resample);
+    int whole = (int) floor(delay);
+    unsigned int frac = (unsigned int) lrint((delay - whole) * (1 << 28));
+
+    if (frac > kPhaseMask) {
+        whole++;
+        frac = 0;
+    }
+    *frames = whole;
+    *fraction = frac;
+}
+
+int64_t resample_delay_ns(const struct resample_para *resample) {
+    return (int64_t) (resample_delay_frames(resample) * 1000000000.0 / resample->input_sr);
+}
+
+int resample_process_bounded(struct resample_para *resample, unsigned int *in_frame,
+        short* input, short* output, unsigned int out_frame) {
+    unsigned int fit = resample_in_frames(resample, out_frame);
+
+    if (fit < *in_frame)
+        *in_frame = fit;
+    if (*in_frame == 0)
+        return 0;
+    return resample_process(resample, *in_frame, input, output);
+}
+
+int resample_process(struct resample_para *resample, unsigned int in_frame,
+        short* input, short* output) {
+    if (resample->format != RESAMPLE_FORMAT_S16)
+        return -EINVAL;
+    return resample->kernel(resample, in_frame, input, output);
+}
+
+int resample_process_s24(struct resample_para *resample, unsigned int in_frame,
+        const int32_t *input, int32_t *output) {
+    if (resample->format != RESAMPLE_FORMAT_S24)
+        return -EINVAL;
+    switch (resample->channels) {
+    case 1:
+        return resample_i32(resample, in_frame, input, output, 1, RESAMPLE_FORMAT_S24);
+    case 2:
+        return resample_i32(resample, in_frame, input, output, 2, RESAMPLE_FORMAT_S24);
+    case 6:
+        return resample_i32(resample, in_frame, input, output, 6, RESAMPLE_FORMAT_S24);
+    case 8:
+        return resample_i32(resample, in_frame, input, output, 8, RESAMPLE_FORMAT_S24);
+    default:
+        return resample_i32(resample, in_frame, input, output, resample->channels,
+                RESAMPLE_FORMAT_S24);
+    }
+}
+
+int resample_process_s32(struct resample_para *resample, unsigned int in_frame,
+        const int32_t *input, int32_t *output) {
+    if (resample->format != RESAMPLE_FORMAT_S32)
+        return -EINVAL;
+    switch (resample->channels) {
+    case 1:
+        return resample_i32(resample, in_frame, input, output, 1, RESAMPLE_FORMAT_S32);
+    case 2:
+        return resample_i32(resample, in_frame, input, output, 2, RESAMPLE_FORMAT_S32);
+    case 6:
+        return resample_i32(resample, in_frame, input, output, 6, RESAMPLE_FORMAT_S32);
+    case 8:
+        return resample_i32(resample, in_frame, input, output, 8, RESAMPLE_FORMAT_S32);
+    default:
+        return resample_i32(resample, in_frame, input, output, resample->channels,
+                RESAMPLE_FORMAT_S32);
+    }
+}
+
+int resample_process_float(struct resample_para *resample, unsigned int in_frame,
+        const float *input, float *output) {
+    if (resample->format != RESAMPLE_FORMAT_FLOAT)
+        return -EINVAL;
+    switch (resample->channels) {
+    case 1:
+        return resample_float(resample, in_frame, input, output, 1);
+    case 2:
+        return resample_float(resample, in_frame, input, output, 2);
+    case 6:
+        return resample_float(resample, in_frame, input, output, 6);
+    case 8:
+        return resample_float(resample, in_frame, input, output, 8);
+    default:
+        return resample_float(resample, in_frame, input, output, resample->channels);
+    }
+}
+
+/*
+ * Batch of streams that share rates, channel count and quality. They
+ * advance in lock step, so one phase walk and one coefficient row serve
+ * every stream for each output frame. The per stream state (last frame
+ * for linear, FIR history otherwise) sits back to back in one block.
+ */
+static unsigned int batch_stride(const struct resample_batch *batch) {
+    const struct resample_para *para = &batch->para;
+
+    if (para->fir != NULL)
+        return 2 * (para->fir->taps - 1) * para->channels;
+    return para->channels;
+}
+
+int resampler_batch_init(struct resample_batch *batch, unsigned int streams) {
+    struct resample_para *para = &batch->para;
+
+    batch->state = NULL;
+    if (streams == 0 || para->channels == 0 || para->channels > RESAMPLE_MAX_CHANNELS)
+        return -EINVAL;
+    batch->streams = streams;
+    phase_init(para);
+    para->fir = NULL;
+    para->history = NULL;
+    para->cascade = NULL;
+    para->in_channels = para->channels;
+    para->format = RESAMPLE_FORMAT_S16;
+    para->kernel = NULL;
+    if (para->quality > RESAMPLE_QUALITY_HIGH)
+        para->quality = RESAMPLE_QUALITY_HIGH;
+    if (para->quality != RESAMPLE_QUALITY_LINEAR) {
+        para->fir = fir_get(para->quality, fir_taps(para), fir_cutoff(para), para->ratio);
+        if (para->fir == NULL) {
+            ALOGE("%s, no memory for FIR tables, falling back to linear", __FUNCTION__);
+            para->quality = RESAMPLE_QUALITY_LINEAR;
+        }
+    }
+    batch->state = calloc(streams * batch_stride(batch), sizeof(short));
+    if (batch->state == NULL) {
+        resampler_batch_release(batch);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+inline static int batch_linear_n(struct resample_batch *batch, unsigned int in_frame,
+        short **input, short **output, const unsigned int channels) {
+    struct resample_para *para = &batch->para;
+    struct resample_phase ph = { para->SampleSkip, para->SampleFraction, 0 };
+    unsigned int s, c;
+
+    while (ph.index < in_frame) {
+        int w = phase_weight(&ph, para);
+
+        for (s = 0; s < batch->streams; s++) {
+            const short *cur = input[s] + ph.index * channels;
+            const short *prev = (ph.index > 0) ? cur - channels : batch->state + s * channels;
+            short *out = output[s] + ph.out * channels;
+
+            for (c = 0; c < channels; c++)
+                out[c] = interp(prev[c], cur[c], w);
+        }
+        phase_step(&ph, para);
+    }
+
+    if (in_frame > 0) {
+        for (s = 0; s < batch->streams; s++)
+            memcpy(batch->state + s * channels, input[s] + (in_frame - 1) * channels,
+                    channels * sizeof(short));
+    }
+    phase_save(para, &ph, in_frame);
+    return ph.out;
+}
+
+/* same history layout as resample_fir_n(), one area per stream */
+inline static int batch_fir_n(struct resample_batch *batch, unsigned int in_frame,
+        short **input, short **output, const unsigned int channels) {
+    struct resample_para *para = &batch->para;
+    const struct resample_fir *fir = para->fir;
+    int taps = fir->taps;
+    unsigned int hist = taps - 1, stride = 2 * hist * channels;
+    unsigned int head = (in_frame < hist) ? in_frame : hist, s;
+    struct resample_phase ph = { para->SampleSkip, para->SampleFraction, 0 };
+
+    for (s = 0; s < batch->streams; s++)
+        memcpy(batch->state + s * stride + hist * channels, input[s],
+                head * channels * sizeof(short));
+
+    while (ph.index < in_frame) {
+        const int32_t *h = fir_row(fir, ph.frac);
+
+        for (s = 0; s < batch->streams; s++) {
+            const short *src = (ph.index < head) ?
+                    batch->state + s * stride + ph.index * channels :
+                    input[s] + (ph.index - hist) * channels;
+
+            fir_frame(output[s] + ph.out * channels, src, h, taps, channels);
+        }
+        phase_step(&ph, para);
+    }
+
+    for (s = 0; s < batch->streams; s++) {
+        short *ext = batch->state + s * stride;
+
+        if (in_frame >= hist)
+            memcpy(ext, input[s] + (in_frame - hist) * channels,
+                    hist * channels * sizeof(short));
+        else
+            memmove(ext, ext + in_frame * channels, hist * channels * sizeof(short));
+    }
+    phase_save(para, &ph, in_frame);
+    return ph.out;
+}
+
+int resample_batch_process(struct resample_batch *batch, unsigned int in_frame,
+        short **input, short **output) {
+    unsigned int channels = batch->para.channels;
+
+    if (batch->para.fir != NULL) {
+        switch (channels) {
+        case 1:
+            return batch_fir_n(batch, in_frame, input, output, 1);
+        case 2:
+            return batch_fir_n(batch, in_frame, input, output, 2);
+        default:
+            return batch_fir_n(batch, in_frame, input, output, channels);
+        }
+    }
+    switch (channels) {
+    case 1:
+        return batch_linear_n(batch, in_frame, input, output, 1);
+    case 2:
+        return batch_linear_n(batch, in_frame, input, output, 2);
+    default:
+        return batch_linear_n(batch, in_frame, input, output, channels);
+    }
+}
+
+void resampler_batch_release(struct resample_batch *batch) {
+    resampler_release(&batch->para);
+    free(batch->state);
+    batch->state = NULL;
+}
+
+#ifndef RESAMPLER_HOST_BUILD
+/*
+ * Pull-mode front end with the libaudioutils resampler_itfe shape, so that
+ * HAL code written against create_resampler() can run on this engine.
+ * Output that does not fit the caller's buffer, which happens when one
+ * input frame makes several output frames, is kept in pending and handed
+ * out first on the next call.
+ */
+struct aml_resampler {
+    struct resampler_itfe itfe;
+    struct resample_para para;
+    struct resampler_buffer_provider *provider;
+    short *pending;
+    unsigned int pending_frames;
+    unsigned int pending_offset;
+    unsigned int pending_max;
+};
+
+static size_t aml_resampler_drain(struct aml_resampler *rs, int16_t *out, size_t frames) {
+    unsigned int channels = rs->para.channels;
+
+    if (frames > rs->pending_frames)
+        frames = rs->pending_frames;
+    memcpy(out, rs->pending + rs->pending_offset * channels, frames * channels * sizeof(short));
+    rs->pending_offset += frames;
+    rs->pending_frames -= frames;
+    return frames;
+}
+
+/*
+ * Converts up to *in_count input frames into at most out_count output
+ * frames. It always consumes at least one input frame, parking the output
+ * that does not fit.
+ */
+static size_t aml_resampler_run(struct aml_resampler *rs, int16_t *in, size_t *in_count,
+        int16_t *out, size_t out_count) {
+    unsigned int frames = *in_count;
+    int n = resample_process_bounded(&rs->para, &frames, in, out, out_count);
+
+    if (frames == 0 && *in_count > 0) {
+        frames = 1;
+        rs->pending_frames = resample_process(&rs->para, 1, in, rs->pending);
+        rs->pending_offset = 0;
+        n = aml_resampler_drain(rs, out, out_count);
+    }
+    *in_count = frames;
+    return (n > 0) ? n : 0;
+}
+
+static void aml_resampler_reset(struct resampler_itfe *resampler) {
+    struct aml_resampler *rs = (struct aml_resampler *) resampler;
+
+    rs->para.SampleFraction = 0;
+    rs->para.SampleSkip = 0;
+    memset(rs->para.lastsample, 0, sizeof(rs->para.lastsample));
+    if (rs->para.history != NULL)
+        memset(rs->para.history, 0, 2 * (rs->para.fir->taps - 1) * rs->para.channels *
+                sizeof(short));
+    if (rs->para.cascade != NULL) {
+        struct resample_cascade *cs = rs->para.cascade;
+        int i;
+
+        for (i = 0; i < cs->stages; i++) {
+            cs->hb[i].phase = 0;
+            memset(cs->hb[i].work, 0, (cs->decimate ? 4 * cs->hb[i].pairs - 2 :
+                    2 * cs->hb[i].pairs - 1) * rs->para.channels * sizeof(short));
+        }
+        cs->frac.SampleFraction = 0;
+        cs->frac.SampleSkip = 0;
+        memset(cs->frac.history, 0, 2 * (cs->frac.fir->taps - 1) * rs->para.channels *
+                sizeof(short));
+    }
+    rs->pending_frames = 0;
+}
+
+static int aml_resampler_from_provider(struct resampler_itfe *resampler, int16_t *out,
+        size_t *outFrameCount) {
+    struct aml_resampler *rs = (struct aml_resampler *) resampler;
+    unsigned int channels = rs->para.channels;
+    size_t want = *outFrameCount, done = 0;
+
+    if (rs->provider == NULL) {
+        *outFrameCount = 0;
+        return -EINVAL;
+    }
+
+    done = aml_resampler_drain(rs, out, want);
+    while (done < want) {
+        struct resampler_buffer buf;
+        size_t used;
+
+        buf.frame_count = resample_in_frames(&rs->para, want - done);
+        if (buf.frame_count == 0)
+            buf.frame_count = 1;
+        rs->provider->get_next_buffer(rs->provider, &buf);
+        if (buf.raw == NULL || buf.frame_count == 0)
+            break;
+        used = buf.frame_count;
+        done += aml_resampler_run(rs, buf.i16, &used, out + done * channels, want - done);
+        buf.frame_count = used;
+        rs->provider->release_buffer(rs->provider, &buf);
+    }
+    *outFrameCount = done;
+    return 0;
+}
+
+static int aml_resampler_from_input(struct resampler_itfe *resampler, int16_t *in,
+        size_t *inFrameCount, int16_t *out, size_t *outFrameCount) {
+    struct aml_resampler *rs = (struct aml_resampler *) resampler;
+    unsigned int channels = rs->para.channels;
+    size_t want = *outFrameCount, done, used = 0;
+
+    done = aml_resampler_drain(rs, out, want);
+    while (done < want && used < *inFrameCount) {
+        size_t count = *inFrameCount - used;
+
+        done += aml_resampler_run(rs, in + used * channels, &count, out + done * channels,
+                want - done);
+        used += count;
+    }
+    *inFrameCount = used;
+    *outFrameCount = done;
+    return 0;
+}
+
+static int32_t aml_resampler_delay_ns(struct resampler_itfe *resampler) {
+    struct aml_resampler *rs = (struct aml_resampler *) resampler;
+    int64_t pending = (int64_t) rs->pending_frames * 1000000000 / rs->para.output_sr;
+
+    return (int32_t) (resample_delay_ns(&rs->para) + pending);
+}
+
+int create_aml_resampler(uint32_t inSampleRate, uint32_t outSampleRate, uint32_t channelCount,
+        uint32_t quality, struct resampler_buffer_provider *provider,
+        struct resampler_itfe **resampler) {
+    struct aml_resampler *rs;
+
+    *resampler = NULL;
+    rs = calloc(1, sizeof(*rs));
+    if (rs == NULL)
+        return -ENOMEM;
+    rs->para.input_sr = inSampleRate;
+    rs->para.output_sr = outSampleRate;
+    rs->para.channels = channelCount;
+    rs->para.quality = quality;
+    if (resampler_init(&rs->para)) {
+        free(rs);
+        return -EINVAL;
+    }
+    /* one input frame makes at most this many output frames */
+    rs->pending_max = outSampleRate / inSampleRate + 2 + (1 << CASCADE_MAX_STAGES);
+    rs->pending = malloc(rs->pending_max * channelCount * sizeof(short));
+    if (rs->pending == NULL) {
+        resampler_release(&rs->para);
+        free(rs);
+        return -ENOMEM;
+    }
+    rs->provider = provider;
+    rs->itfe.reset = aml_resampler_reset;
+    rs->itfe.resample_from_provider = aml_resampler_from_provider;
+    rs->itfe.resample_from_input = aml_resampler_from_input;
+    rs->itfe.delay_ns = aml_resampler_delay_ns;
+    *resampler = &rs->itfe;
+    return 0;
+}
+
+void release_aml_resampler(struct resampler_itfe *resampler) {
+    struct aml_resampler *rs = (struct aml_resampler *) resampler;
+
+    if (rs == NULL)
+        return;
+    resampler_release(&rs->para);
+    free(rs->pending);
+    free(rs);
+}
+#endif
@@ -1,19 +1,151 @@
-#ifndef __AUDIO_RESAMPLER_H__
-#define __AUDIO_RESAMPLER_H__
-
-struct resample_para {
-    unsigned int FractionStep;
-    unsigned int SampleFraction;
-    short lastsample_left;
-    short lastsample_right;
-    unsigned int input_sr;
-    unsigned int output_sr;
-    unsigned int channels;
-};
-
-int resampler_init(struct resample_para *resample);
-int resample_process(struct resample_para *resample, unsigned int in_frame,
-	short* input, short* output);
-
-
-#endif
+#ifndef __AUDIO_RESAMPLER_H__
+#define __AUDIO_RESAMPLER_H__
+
+#include <stdint.h>
+
+/* interpolation used by resample_process(), picked in resampler_init() */
+enum resample_quality {
+    RESAMPLE_QUALITY_LINEAR = 0,    /* two-tap linear, the historical default */
+    RESAMPLE_QUALITY_LOW,           /* 16-tap polyphase windowed sinc */
+    RESAMPLE_QUALITY_MEDIUM,        /* 32-tap polyphase windowed sinc */
+    RESAMPLE_QUALITY_HIGH,          /* 64-tap polyphase windowed sinc */
+};
+
+/* sample layout of input and output, set before resampler_init() */
+enum resample_format {
+    RESAMPLE_FORMAT_S16 = 0,        /* resample_process() */
+    RESAMPLE_FORMAT_S24,            /* resample_process_s24(), 24 bits in the low 3 bytes */
+    RESAMPLE_FORMAT_S32,            /* resample_process_s32() */
+    RESAMPLE_FORMAT_FLOAT,          /* resample_process_float() */
+};
+
+#define RESAMPLE_MAX_CHANNELS 8
+
+struct resample_para;
+struct resample_fir;
+struct resample_ratio;
+struct resample_cascade;
+
+typedef int (*resample_kernel_t)(struct resample_para *resample, unsigned int in_frame,
+	short* input, short* output);
+
+struct resample_para {
+    unsigned int FractionStep;
+    unsigned int SampleFraction;
+    /* input frames the last step of the previous call jumped past */
+    unsigned int SampleSkip;
+    /* last input frame of the previous call, one sample per channel */
+    short lastsample[RESAMPLE_MAX_CHANNELS];
+    /* the same for the 32-bit formats */
+    union {
+        int32_t i[RESAMPLE_MAX_CHANNELS];
+        float f[RESAMPLE_MAX_CHANNELS];
+    } last32;
+    unsigned int input_sr;
+    unsigned int output_sr;
+    /* interleaved channels of both input and output, 1 to RESAMPLE_MAX_CHANNELS */
+    unsigned int channels;
+    unsigned int quality;
+    unsigned int format;
+    /* inner loop picked by resampler_init() from channels and CPU features */
+    resample_kernel_t kernel;
+    /* polyphase coefficients, shared by all resamplers with the same ratio */
+    const struct resample_fir *fir;
+    /* taps - 1 frames of FIR history, followed by as much scratch */
+    void *history;
+    /* exact L/M phase tables for common rate pairs, NULL to use FractionStep */
+    const struct resample_ratio *ratio;
+    /* interleaved input channels and Q14 mix matrix, see resampler_set_mix() */
+    unsigned int in_channels;
+    short mix[RESAMPLE_MAX_CHANNELS * RESAMPLE_MAX_CHANNELS];
+    /* half-band stages planned by resampler_init() for large S16 ratios, or NULL */
+    struct resample_cascade *cascade;
+};
+
+int resampler_init(struct resample_para *resample);
+int resample_process(struct resample_para *resample, unsigned int in_frame,
+	short* input, short* output);
+int resample_process_s24(struct resample_para *resample, unsigned int in_frame,
+	const int32_t *input, int32_t *output);
+int resample_process_s32(struct resample_para *resample, unsigned int in_frame,
+	const int32_t *input, int32_t *output);
+int resample_process_float(struct resample_para *resample, unsigned int in_frame,
+	const float *input, float *output);
+/* exact number of frames the next call with in_frame input frames will write */
+unsigned int resample_out_frames(const struct resample_para *resample, unsigned int in_frame);
+/*
+ * S16 processing that writes at most out_frame frames. On return *in_frame
+ * holds the input frames consumed. It stays 0 if out_frame cannot hold the
+ * output of a single input frame.
+ */
+int resample_process_bounded(struct resample_para *resample, unsigned int *in_frame,
+	short* input, short* output, unsigned int out_frame);
+/*
+ * How far the next output frame lags the last input frame passed in, in
+ * input frames: *frames plus *fraction / (1 << 28), rounded down so the
+ * fraction is never negative. Covers the filter group delay, the phase
+ * and skip carried into the next call and any half-band stages. Linear
+ * quality interpolates up to a frame ahead, so the delay can be below 0.
+ */
+void resample_delay(const struct resample_para *resample, int *frames,
+	unsigned int *fraction);
+/* the same delay in nanoseconds of input */
+int64_t resample_delay_ns(const struct resample_para *resample);
+void resampler_release(struct resample_para *resample);
+int resampler_quality_from_string(const char *name);
+/* passband and stopband edges of a quality, as fractions of the lower Nyquist; 0 for linear */
+double resampler_passband(int quality);
+double resampler_stopband(int quality);
+/*
+ * Call after resampler_init(), S16 only. From then on resample_process()
+ * takes in_channels interleaved input, and output channel c is
+ * gain * sum(matrix[c * in_channels + k] * input channel k), mixed in the
+ * same pass as the rate conversion. Setting it back to an identity matrix
+ * at unity gain returns to the plain kernels.
+ */
+int resampler_set_mix(struct resample_para *resample, unsigned int in_channels,
+	const float *matrix, float gain);
+/*
+ * Kernel override for benchmarking: "c", "sse2" or "neon". Only
+ * for linear quality, returns -ENOSYS if the build or CPU lacks it.
+ */
+int resampler_set_kernel(struct resample_para *resample, const char *name);
+const char *resampler_kernel_name(const struct resample_para *resample);
+
+
+/*
+ * Several S16 streams at one ratio, processed together. Fill in input_sr,
+ * output_sr, channels and quality of para, then call
+ * resampler_batch_init(). Every call takes in_frame frames from each of
+ * input[0..streams) and writes the returned frame count to each output;
+ * the streams share the phase and the coefficient table. Batches always
+ * run a single stage.
+ */
+struct resample_batch {
+    struct resample_para para;
+    unsigned int streams;
+    /* per stream history, streams areas back to back */
+    short *state;
+};
+
+int resampler_batch_init(struct resample_batch *batch, unsigned int streams);
+int resample_batch_process(struct resample_batch *batch, unsigned int in_frame,
+	short **input, short **output);
+void resampler_batch_release(struct resample_batch *batch);
+
+
+#ifndef RESAMPLER_HOST_BUILD
+#include <audio_utils/resampler.h>
+
+/*
+ * Same contract as libaudioutils create_resampler(), running on this
+ * engine. quality is an enum resample_quality. Release with
+ * release_aml_resampler(), not release_resampler().
+ */
+int create_aml_resampler(uint32_t inSampleRate, uint32_t outSampleRate, uint32_t channelCount,
+	uint32_t quality, struct resampler_buffer_provider *provider,
+	struct resampler_itfe **resampler);
+void release_aml_resampler(struct resampler_itfe *resampler);
+#endif
+
+#endif
@@ -0,0 +1,544 @@
+/*
+ * Throughput and quality report for audio_resampler.c, built for the host.
+ *
+ * Android:  mmm with BOARD_USE_USB_AUDIO, produces audio_resampler_bench
+ * Linux:    gcc -O2 -DRESAMPLER_HOST_BUILD -o audio_resampler_bench \
+ *               audio_resampler_bench.c audio_resampler.c -lm -lpthread
+ *
+ * usage: audio_resampler_bench [-b] [-q] [-d seconds]
+ *   -b  throughput only, -q  quality only,
+ *   -d  length of the simulated stream for the drift test (default 3600)
+ *
+ * Throughput is in million input frames per second, summed over the four
+ * streams for the batch4 lines. Quality figures are
+ * taken from least squares sine fits on the 16-bit output:
+ *   thd+n     residual after removing a -1 dBFS 997 Hz tone
+ *   ripple    peak to peak gain from 20 Hz to the passband edge of the
+ *             quality, 0.9 of the lower Nyquist for linear
+ *   stopband  worst image (interpolation) or alias (decimation) that lands
+ *             between the stopband edge of the quality and the Nyquist of
+ *             the higher rate, from the lower Nyquist for linear
+ *   drift     tone phase error accumulated over the simulated stream, for
+ *             every quality; "exact" marks pairs on an L/M phase table
+ *   full-scale  frames of full-scale square waves that are wrapped rather
+ *             than clipped
+ * A tier that measures worse than the one below it on any of thd+n, ripple
+ * or stopband, or any full-scale frame, makes the bench exit with status 1.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio_resampler.h"
+
+#define AMPLITUDE   (0.891 * 32767)     /* -1 dBFS */
+#define SETTLE      1024                /* output frames skipped before fitting */
+#define STOP_POINTS 16                  /* tones swept across the stopband */
+
+struct rate_pair {
+    unsigned int in;
+    unsigned int out;
+};
+
+static const struct rate_pair kPairs[] = {
+    { 44100, 48000 },
+    { 48000, 44100 },
+    {  8000, 48000 },
+    { 16000, 48000 },
+    { 48000, 96000 },
+    { 44100, 32000 },
+    { 192000, 48000 },
+    { 48000, 192000 },
+};
+
+static const char *kQualities[] = { "linear", "low", "medium", "high" };
+static const char *kKernelNames[] = { "c", "sse2", "neon" };
+static const unsigned int kChannels[] = { 1, 2, 6, 8 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int setup(struct resample_para *rs, const struct rate_pair *pair,
+        unsigned int channels, unsigned int quality, unsigned int format) {
+    memset(rs, 0, sizeof(*rs));
+    rs->input_sr = pair->in;
+    rs->output_sr = pair->out;
+    rs->channels = channels;
+    rs->quality = quality;
+    rs->format = format;
+    return resampler_init(rs);
+}
+
+/*
+ * Amplitude and phase of the tone at freq Hz in y, whose first frame is
+ * frame start of a stream at rate Hz. The reference phase is reduced with
+ * integer arithmetic so that it stays exact for hour-long streams.
+ */
+static void fit_tone(const short *y, unsigned int n, unsigned int stride, int64_t start,
+        unsigned int freq, unsigned int rate, double *amp, double *phase, double *residual) {
+    double cc = 0, ss = 0, cs = 0, yc = 0, ys = 0, a, b, det, err = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        double t = 2 * M_PI * (double) (((start + i) * freq) % rate) / rate;
+        double c = cos(t), s = sin(t), v = y[i * stride];
+
+        cc += c * c;
+        ss += s * s;
+        cs += c * s;
+        yc += v * c;
+        ys += v * s;
+    }
+    det = cc * ss - cs * cs;
+    a = (yc * ss - ys * cs) / det;
+    b = (ys * cc - yc * cs) / det;
+    if (residual != NULL) {
+        for (i = 0; i < n; i++) {
+            double t = 2 * M_PI * (double) (((start + i) * freq) % rate) / rate;
+            double e = y[i * stride] - a * cos(t) - b * sin(t);
+
+            err += e * e;
+        }
+        *residual = err / n;
+    }
+    *amp = sqrt(a * a + b * b);
+    *phase = atan2(a, b);
+}
+
+/*
+ * Two seconds of tone through a fresh resampler. The fits then take
+ * exactly one second of output from SETTLE on, over which tones a whole
+ * number of Hz apart are orthogonal: a -1 dBFS tone does not leak into
+ * the fit of an image 90 dB below it.
+ */
+static void run_tone(const struct rate_pair *pair, unsigned int quality,
+        unsigned int freq, short **out) {
+    struct resample_para rs;
+    unsigned int i, frames = 2 * pair->in;
+    short *in = malloc(frames * sizeof(short));
+
+    setup(&rs, pair, 1, quality, RESAMPLE_FORMAT_S16);
+    for (i = 0; i < frames; i++)
+        in[i] = lrint(AMPLITUDE * sin(2 * M_PI * (double) ((uint64_t) i * freq % pair->in) /
+                pair->in));
+    *out = malloc(resample_out_frames(&rs, frames) * sizeof(short));
+    resample_process(&rs, frames, in, *out);
+    resampler_release(&rs);
+    free(in);
+}
+
+static double tone_gain_db(const struct rate_pair *pair, unsigned int quality,
+        unsigned int freq, unsigned int measure) {
+    short *out;
+    double amp, phase;
+
+    run_tone(pair, quality, freq, &out);
+    fit_tone(out + SETTLE, pair->out, 1, SETTLE, measure, pair->out, &amp, &phase, NULL);
+    free(out);
+    return 20 * log10(amp / AMPLITUDE + 1e-12);
+}
+
+static double thd_n_db(const struct rate_pair *pair, unsigned int quality) {
+    short *out;
+    double amp, phase, residual;
+
+    run_tone(pair, quality, 997, &out);
+    fit_tone(out + SETTLE, pair->out, 1, SETTLE, 997, pair->out, &amp, &phase, &residual);
+    free(out);
+    return 10 * log10(residual / (amp * amp / 2));
+}
+
+static void ripple_and_stopband(const struct rate_pair *pair, unsigned int quality,
+        double *ripple, double *stopband) {
+    unsigned int low = (pair->in < pair->out) ? pair->in : pair->out;
+    unsigned int high = (pair->in < pair->out) ? pair->out : pair->in;
+    double passband = resampler_passband(quality), stop = resampler_stopband(quality);
+    unsigned int edge, first, last, f, i;
+    double lo = 1e9, hi = -1e9, worst = -200;
+
+    /* linear has no designed edges: its droop up to 0.9, its rejection past the Nyquist */
+    if (passband == 0) {
+        passband = 0.9;
+        stop = 1.0;
+    }
+    edge = low / 2 * passband;
+    for (f = 20; f <= edge; f = (f < 1000) ? f * 2 : f + 1000) {
+        double g = tone_gain_db(pair, quality, f, f);
+
+        if (g < lo)
+            lo = g;
+        if (g > hi)
+            hi = g;
+    }
+    *ripple = hi - lo;
+
+    /*
+     * The stopband runs from stop * low / 2 to the Nyquist of the higher
+     * rate. Interpolation images a tone f at in - f, so only images under
+     * in are swept; decimation aliases a tone to its distance from the
+     * nearest multiple of out.
+     */
+    first = stop * low / 2 + 1;
+    last = high / 2;
+    if (pair->out > pair->in && pair->in < last)
+        last = pair->in;
+    for (i = 0; first < last && i < STOP_POINTS; i++) {
+        unsigned int at = first + (uint64_t) (last - 1 - first) * i / (STOP_POINTS - 1);
+        unsigned int alias;
+        double g;
+
+        if (pair->out > pair->in) {
+            f = pair->in - at;
+            alias = at;
+        } else {
+            f = at;
+            alias = f % pair->out;
+            if (alias > pair->out / 2)
+                alias = pair->out - alias;
+        }
+        g = tone_gain_db(pair, quality, f, alias);
+        if (g > worst)
+            worst = g;
+    }
+    /* near unity, the stopband of the better tiers starts past the output Nyquist */
+    *stopband = (worst > -200) ? -worst : NAN;
+}
+
+/* a square wave of amplitude level and half period half, resampled */
+static unsigned int run_square(const struct rate_pair *pair, unsigned int quality,
+        short level, unsigned int half, short **out) {
+    struct resample_para rs;
+    unsigned int i, n;
+    short *in = malloc(pair->in * sizeof(short));
+
+    setup(&rs, pair, 1, quality, RESAMPLE_FORMAT_S16);
+    for (i = 0; i < pair->in; i++)
+        in[i] = (i / half) & 1 ? -level : level;
+    *out = malloc(resample_out_frames(&rs, pair->in) * sizeof(short));
+    n = resample_process(&rs, pair->in, in, *out);
+    resampler_release(&rs);
+    free(in);
+    return n;
+}
+
+/*
+ * Full-scale square waves drive every accumulator to its worst case: a
+ * 50 Hz one, and one at a quarter of the input rate whose signs line up
+ * with those of the half-band taps. The output has to be four times that
+ * of the same wave at a quarter of the level. Clipping between cascade
+ * stages takes the ringing off and may move a frame by a fraction of full
+ * scale; a wrapped accumulator moves it by about all of it. Returns the
+ * frames that are off by more than half of full scale.
+ */
+static unsigned int full_scale_errors(const struct rate_pair *pair, unsigned int quality) {
+    unsigned int halves[] = { pair->in / 100, 2 }, h, i, n, errors = 0;
+    short *full, *quarter;
+
+    for (h = 0; h < ARRAY_SIZE(halves); h++) {
+        n = run_square(pair, quality, 4 * 8191, halves[h], &full);
+        run_square(pair, quality, 8191, halves[h], &quarter);
+        for (i = 0; i < n; i++) {
+            int expect = 4 * quarter[i];
+
+            if (expect > 32767)
+                expect = 32767;
+            if (expect < -32768)
+                expect = -32768;
+            if (abs(full[i] - expect) > 16384)
+                errors++;
+        }
+        free(full);
+        free(quarter);
+    }
+    return errors;
+}
+
+/*
+ * Phase error of a 1 kHz tone after seconds of stream, in microseconds.
+ * exact is set when the pair runs on an L/M phase table.
+ */
+static double drift_us(const struct rate_pair *pair, unsigned int quality,
+        unsigned int seconds, int *exact) {
+    enum { CHUNK = 16384 };
+    struct resample_para rs;
+    short in[CHUNK], *out;
+    int64_t pos = 0, total = (int64_t) pair->in * seconds, produced = 0;
+    double amp, start_phase = 0, end_phase = 0, err;
+    unsigned int i, n;
+
+    setup(&rs, pair, 1, quality, RESAMPLE_FORMAT_S16);
+    *exact = rs.ratio != NULL;
+    out = malloc(resample_out_frames(&rs, CHUNK + 1) * sizeof(short));
+    while (pos < total) {
+        unsigned int count = (total - pos < CHUNK) ? total - pos : CHUNK;
+
+        for (i = 0; i < count; i++)
+            in[i] = lrint(AMPLITUDE * sin(2 * M_PI * (double) ((pos + i) * 1000 % pair->in) /
+                    pair->in));
+        n = resample_process(&rs, count, in, out);
+        if (pos == 0)
+            fit_tone(out + SETTLE, n - SETTLE, 1, SETTLE, 1000, pair->out, &amp, &start_phase,
+                    NULL);
+        else if (pos + count >= total)
+            fit_tone(out, n, 1, produced, 1000, pair->out, &amp, &end_phase, NULL);
+        produced += n;
+        pos += count;
+    }
+    resampler_release(&rs);
+    free(out);
+
+    err = end_phase - start_phase;
+    while (err > M_PI)
+        err -= 2 * M_PI;
+    while (err < -M_PI)
+        err += 2 * M_PI;
+    return err / (2 * M_PI * 1000) * 1e6;
+}
+
+/*
+ * Every tier has to measure at least as well as the one below it; ties
+ * within the slack are the 16-bit floor rather than the filters.
+ */
+static unsigned int tier_order_errors(const struct rate_pair *pair, const double *thd,
+        const double *ripple, const double *stopband) {
+    unsigned int q, errors = 0;
+
+    for (q = RESAMPLE_QUALITY_MEDIUM; q < ARRAY_SIZE(kQualities); q++) {
+        const char *what = NULL;
+
+        if (thd[q] > thd[q - 1] + 0.5)
+            what = "thd+n";
+        else if (ripple[q] > ripple[q - 1] + 0.001)
+            what = "ripple";
+        else if (stopband[q] < stopband[q - 1] - 0.5)
+            what = "stopband";
+        if (what != NULL) {
+            printf("%6u->%-6u %s of %s is worse than %s\n", pair->in, pair->out, what,
+                    kQualities[q], kQualities[q - 1]);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/* returns the number of failed checks */
+static unsigned int quality_report(unsigned int seconds) {
+    unsigned int p, q, failed = 0;
+
+    printf("%-14s %-7s %9s %9s %9s\n", "ratio", "quality", "thd+n dB", "ripple dB",
+            "stop dB");
+    for (p = 0; p < ARRAY_SIZE(kPairs); p++) {
+        double thd[ARRAY_SIZE(kQualities)], ripple[ARRAY_SIZE(kQualities)];
+        double stopband[ARRAY_SIZE(kQualities)];
+
+        for (q = 0; q < ARRAY_SIZE(kQualities); q++) {
+            ripple_and_stopband(&kPairs[p], q, &ripple[q], &stopband[q]);
+            thd[q] = thd_n_db(&kPairs[p], q);
+            printf("%6u->%-6u %-7s %9.1f %9.3f ", kPairs[p].in, kPairs[p].out,
+                    kQualities[q], thd[q], ripple[q]);
+            if (isnan(stopband[q]))
+                printf("%9s\n", "-");
+            else
+                printf("%9.1f\n", stopband[q]);
+        }
+        failed += tier_order_errors(&kPairs[p], thd, ripple, stopband);
+    }
+
+    printf("\n%-14s %-6s drift in us after %u s\n", "ratio", "phase", seconds);
+    printf("%-14s %-6s", "", "");
+    for (q = 0; q < ARRAY_SIZE(kQualities); q++)
+        printf(" %9s", kQualities[q]);
+    printf("\n");
+    for (p = 0; p < ARRAY_SIZE(kPairs); p++) {
+        double drift[ARRAY_SIZE(kQualities)];
+        int exact = 0;
+
+        for (q = 0; q < ARRAY_SIZE(kQualities); q++)
+            drift[q] = drift_us(&kPairs[p], q, seconds, &exact);
+        printf("%6u->%-6u %-6s", kPairs[p].in, kPairs[p].out, exact ? "exact" : "4.28");
+        for (q = 0; q < ARRAY_SIZE(kQualities); q++)
+            printf(" %9.3f", drift[q]);
+        printf("\n");
+    }
+
+    printf("\n%-14s full-scale square, frames off\n", "ratio");
+    for (p = 0; p < ARRAY_SIZE(kPairs); p++) {
+        printf("%6u->%-6u", kPairs[p].in, kPairs[p].out);
+        for (q = 0; q < ARRAY_SIZE(kQualities); q++) {
+            unsigned int errors = full_scale_errors(&kPairs[p], q);
+
+            printf(" %9u", errors);
+            if (errors != 0)
+                failed++;
+        }
+        printf("\n");
+    }
+    return failed;
+}
+
+/* input frames per second, or 0 when the kernel is not available */
+static double throughput(const struct rate_pair *pair, unsigned int channels,
+        unsigned int quality, unsigned int format, const char *kernel) {
+    enum { CHUNK = 1024, ROUNDS = 2000 };
+    struct resample_para rs;
+    size_t width = (format == RESAMPLE_FORMAT_S16) ? sizeof(short) : sizeof(int32_t);
+    void *in, *out;
+    double start, elapsed;
+    unsigned int i;
+
+    if (setup(&rs, pair, channels, quality, format))
+        return 0;
+    if (kernel != NULL && resampler_set_kernel(&rs, kernel)) {
+        resampler_release(&rs);
+        return 0;
+    }
+    in = malloc(CHUNK * channels * width);
+    out = malloc(resample_out_frames(&rs, CHUNK + 1) * channels * width);
+    for (i = 0; i < CHUNK * channels; i++) {
+        int v = rand() % 65536 - 32768;
+
+        if (format == RESAMPLE_FORMAT_S16)
+            ((short *) in)[i] = v;
+        else if (format == RESAMPLE_FORMAT_FLOAT)
+            ((float *) in)[i] = v / 32768.0f;
+        else
+            ((int32_t *) in)[i] = v * 65536;
+    }
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        switch (format) {
+        case RESAMPLE_FORMAT_S16:
+            resample_process(&rs, CHUNK, in, out);
+            break;
+        case RESAMPLE_FORMAT_S32:
+            resample_process_s32(&rs, CHUNK, in, out);
+            break;
+        default:
+            resample_process_float(&rs, CHUNK, in, out);
+            break;
+        }
+    }
+    elapsed = now() - start;
+
+    resampler_release(&rs);
+    free(in);
+    free(out);
+    return (double) CHUNK * ROUNDS / elapsed;
+}
+
+/* input frames per second summed over a batch of BATCH streams */
+static double batch_throughput(const struct rate_pair *pair, unsigned int channels,
+        unsigned int quality) {
+    enum { CHUNK = 1024, ROUNDS = 500, BATCH = 4 };
+    struct resample_batch batch;
+    short *in[BATCH], *out[BATCH];
+    double start, elapsed;
+    unsigned int i, s;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.para.input_sr = pair->in;
+    batch.para.output_sr = pair->out;
+    batch.para.channels = channels;
+    batch.para.quality = quality;
+    if (resampler_batch_init(&batch, BATCH))
+        return 0;
+    for (s = 0; s < BATCH; s++) {
+        in[s] = malloc(CHUNK * channels * sizeof(short));
+        out[s] = malloc(resample_out_frames(&batch.para, CHUNK + 1) * channels * sizeof(short));
+        for (i = 0; i < CHUNK * channels; i++)
+            in[s][i] = rand() % 65536 - 32768;
+    }
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++)
+        resample_batch_process(&batch, CHUNK, in, out);
+    elapsed = now() - start;
+
+    resampler_batch_release(&batch);
+    for (s = 0; s < BATCH; s++) {
+        free(in[s]);
+        free(out[s]);
+    }
+    return (double) CHUNK * ROUNDS * BATCH / elapsed;
+}
+
+static void throughput_report(void) {
+    unsigned int p, c, k, q;
+
+    printf("%-14s %-3s %-12s %12s\n", "ratio", "ch", "engine", "Mframes/s");
+    for (p = 0; p < ARRAY_SIZE(kPairs); p++) {
+        for (c = 0; c < ARRAY_SIZE(kChannels); c++) {
+            for (k = 0; k < ARRAY_SIZE(kKernelNames); k++) {
+                double fps = throughput(&kPairs[p], kChannels[c], RESAMPLE_QUALITY_LINEAR,
+                        RESAMPLE_FORMAT_S16, kKernelNames[k]);
+
+                if (fps > 0)
+                    printf("%6u->%-6u %-3u linear-%-5s %12.1f\n", kPairs[p].in, kPairs[p].out,
+                            kChannels[c], kKernelNames[k], fps / 1e6);
+            }
+            for (q = RESAMPLE_QUALITY_LOW; q < ARRAY_SIZE(kQualities); q++)
+                printf("%6u->%-6u %-3u fir-%-8s %12.1f\n", kPairs[p].in, kPairs[p].out,
+                        kChannels[c], kQualities[q],
+                        throughput(&kPairs[p], kChannels[c], q, RESAMPLE_FORMAT_S16, NULL) / 1e6);
+            for (q = RESAMPLE_QUALITY_LINEAR; q < ARRAY_SIZE(kQualities); q += 3)
+                printf("%6u->%-6u %-3u batch4-%-6s %12.1f\n", kPairs[p].in, kPairs[p].out,
+                        kChannels[c], kQualities[q],
+                        batch_throughput(&kPairs[p], kChannels[c], q) / 1e6);
+            printf("%6u->%-6u %-3u %-12s %12.1f\n", kPairs[p].in, kPairs[p].out,
+                    kChannels[c], "linear-s32",
+                    throughput(&kPairs[p], kChannels[c], RESAMPLE_QUALITY_LINEAR,
+                            RESAMPLE_FORMAT_S32, NULL) / 1e6);
+            printf("%6u->%-6u %-3u %-12s %12.1f\n", kPairs[p].in, kPairs[p].out,
+                    kChannels[c], "linear-float",
+                    throughput(&kPairs[p], kChannels[c], RESAMPLE_QUALITY_LINEAR,
+                            RESAMPLE_FORMAT_FLOAT, NULL) / 1e6);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int bench = 1, quality = 1, opt, failed = 0;
+    unsigned int seconds = 3600;
+
+    while ((opt = getopt(argc, argv, "bqd:")) != -1) {
+        switch (opt) {
+        case 'b':
+            quality = 0;
+            break;
+        case 'q':
+            bench = 0;
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b] [-q] [-d seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (seconds == 0)
+        seconds = 1;
+
+    if (bench)
+        throughput_report();
+    if (bench && quality)
+        printf("\n");
+    if (quality)
+        failed = quality_report(seconds);
+    if (failed)
+        printf("\n%d checks FAILED\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/atomic.h>
+
+#include "audio_ring.h"
+
+int audio_ring_init(struct audio_ring *ring, size_t size)
+{
+    size_t n = 1;
+
+    while (n < size)
+        n <<= 1;
+    ring->base = malloc(n);
+    if (ring->base == NULL)
+        return -ENOMEM;
+    ring->size = n;
+    audio_ring_reset(ring);
+    return 0;
+}
+
+void audio_ring_release(struct audio_ring *ring)
+{
+    free(ring->base);
+    ring->base = NULL;
+    ring->size = 0;
+}
+
+void audio_ring_reset(struct audio_ring *ring)
+{
+    android_atomic_release_store(0, &ring->head);
+    android_atomic_release_store(0, &ring->tail);
+}
+
+size_t audio_ring_used(const struct audio_ring *ring)
+{
+    uint32_t head = (uint32_t)android_atomic_acquire_load(&ring->head);
+    uint32_t tail = (uint32_t)android_atomic_acquire_load(&ring->tail);
+
+    return head - tail;
+}
+
+size_t audio_ring_space(const struct audio_ring *ring)
+{
+    return ring->size - audio_ring_used(ring);
+}
+
+size_t audio_ring_write(struct audio_ring *ring, const void *data, size_t bytes)
+{
+    /* the producer owns head, so only tail needs the acquire */
+    uint32_t head = (uint32_t)ring->head;
+    uint32_t tail = (uint32_t)android_atomic_acquire_load(&ring->tail);
+    size_t space = ring->size - (head - tail);
+    size_t offset = head & (ring->size - 1);
+    size_t first;
+
+    if (bytes > space)
+        bytes = space;
+    first = ring->size - offset;
+    if (first > bytes)
+        first = bytes;
+    memcpy(ring->base + offset, data, first);
+    memcpy(ring->base, (const char *)data + first, bytes - first);
+    /* publish the data before the new head */
+    android_atomic_release_store((int32_t)(head + bytes), &ring->head);
+    return bytes;
+}
+
+size_t audio_ring_read(struct audio_ring *ring, void *data, size_t bytes)
+{
+    uint32_t tail = (uint32_t)ring->tail;
+    uint32_t head = (uint32_t)android_atomic_acquire_load(&ring->head);
+    size_t used = head - tail;
+    size_t offset = tail & (ring->size - 1);
+    size_t first;
+
+    if (bytes > used)
+        bytes = used;
+    first = ring->size - offset;
+    if (first > bytes)
+        first = bytes;
+    memcpy(data, ring->base + offset, first);
+    memcpy((char *)data + first, ring->base, bytes - first);
+    /* hand the space back only once the copy is done */
+    android_atomic_release_store((int32_t)(tail + bytes), &ring->tail);
+    return bytes;
+}
@@ -0,0 +1,33 @@
+#ifndef __AUDIO_RING_H__
+#define __AUDIO_RING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Single-producer/single-consumer byte ring. One thread may call
+ * audio_ring_write() while another calls audio_ring_read(), without locks.
+ * head and tail count bytes since the last reset and are left to wrap;
+ * size is a power of two so that head - tail is always the fill level.
+ */
+struct audio_ring {
+    char *base;
+    size_t size;
+    volatile int32_t head;      /* written by the producer only */
+    volatile int32_t tail;      /* written by the consumer only */
+};
+
+/* size is rounded up to a power of two, returns -ENOMEM on failure */
+int audio_ring_init(struct audio_ring *ring, size_t size);
+void audio_ring_release(struct audio_ring *ring);
+/* only safe while neither side is running */
+void audio_ring_reset(struct audio_ring *ring);
+
+size_t audio_ring_used(const struct audio_ring *ring);
+size_t audio_ring_space(const struct audio_ring *ring);
+
+/* copy up to bytes in or out, returns how many were copied */
+size_t audio_ring_write(struct audio_ring *ring, const void *data, size_t bytes);
+size_t audio_ring_read(struct audio_ring *ring, void *data, size_t bytes);
+
+#endif
@@ -0,0 +1,84 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "audio_timestamp.h"
+
+#define NSEC_PER_SEC 1000000000LL
+/* measurements are blended in with this weight, as 1 / (1 << shift) */
+#define RENDER_CLOCK_SHIFT 3
+/* a prediction this far off the measurement is dropped */
+#define RENDER_CLOCK_RESEED_US 20000
+
+static int64_t timespec_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+int audio_pcm_queued(struct pcm *pcm, unsigned int *queued, struct timespec *timestamp)
+{
+    struct timespec realtime, monotonic;
+    unsigned int avail;
+    int64_t age_rt, age_mono, ns;
+
+    if (pcm_get_htimestamp(pcm, &avail, timestamp) < 0)
+        return -ENODATA;
+    /* past an underrun the hardware has run beyond what was written */
+    if (avail > pcm_get_buffer_size(pcm))
+        return -ENODATA;
+    *queued = pcm_get_buffer_size(pcm) - avail;
+
+    /*
+     * The timestamp is the time of the hardware position above, taken on
+     * CLOCK_REALTIME unless the pcm was opened with monotonic timestamps.
+     * Whichever clock it is close to is the one it came from.
+     */
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    age_rt = timespec_ns(&realtime) - timespec_ns(timestamp);
+    age_mono = timespec_ns(&monotonic) - timespec_ns(timestamp);
+    if (llabs(age_mono) <= llabs(age_rt))
+        return 0;
+    ns = timespec_ns(&monotonic) - age_rt;
+    timestamp->tv_sec = ns / NSEC_PER_SEC;
+    timestamp->tv_nsec = ns % NSEC_PER_SEC;
+    return 0;
+}
+
+void audio_render_clock_reset(struct audio_render_clock *clock, unsigned int rate)
+{
+    clock->rate = rate;
+    clock->valid = false;
+    clock->end_us = 0;
+}
+
+void audio_render_clock_update(struct audio_render_clock *clock, size_t frames,
+        uint64_t held, const struct timespec *timestamp)
+{
+    int64_t measured, predicted, error;
+
+    measured = timespec_ns(timestamp) / 1000 + (int64_t)(held * 1000000 / clock->rate);
+    predicted = clock->end_us + (int64_t)frames * 1000000 / clock->rate;
+    error = measured - predicted;
+    if (!clock->valid || error > RENDER_CLOCK_RESEED_US || error < -RENDER_CLOCK_RESEED_US) {
+        clock->end_us = measured;
+        clock->valid = true;
+        return;
+    }
+    /* the hardware position only moves per period, so follow it smoothly */
+    clock->end_us = predicted + error / (1 << RENDER_CLOCK_SHIFT);
+}
+
+int audio_render_clock_next(const struct audio_render_clock *clock, int64_t *timestamp)
+{
+    struct timespec now;
+    int64_t now_us;
+
+    if (!clock->valid)
+        return -ENODATA;
+    /* drained already: the next write plays as soon as it is written */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_us = timespec_ns(&now) / 1000;
+    *timestamp = clock->end_us > now_us ? clock->end_us : now_us;
+    return 0;
+}
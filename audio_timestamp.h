@@ -0,0 +1,37 @@
+#ifndef __AUDIO_TIMESTAMP_H__
+#define __AUDIO_TIMESTAMP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <tinyalsa/asoundlib.h>
+
+/*
+ * Frames written to pcm but not played yet, and the CLOCK_MONOTONIC time
+ * at which that was so. Returns 0, or a negative errno while the pcm is
+ * not running or has underrun.
+ */
+int audio_pcm_queued(struct pcm *pcm, unsigned int *queued, struct timespec *timestamp);
+
+/*
+ * Render clock of an output stream: predicts the CLOCK_MONOTONIC time, in
+ * microseconds, at which everything written so far has been played, which
+ * is when the next write starts playing. Each write moves the prediction
+ * on by its own duration, and a measurement of what is still held pulls it
+ * back towards the hardware; a measurement far off, as after an underrun,
+ * reseeds it.
+ */
+struct audio_render_clock {
+    unsigned int rate;
+    bool valid;
+    int64_t end_us;
+};
+
+void audio_render_clock_reset(struct audio_render_clock *clock, unsigned int rate);
+/* frames were just written and held frames are still to play at timestamp */
+void audio_render_clock_update(struct audio_render_clock *clock, size_t frames,
+        uint64_t held, const struct timespec *timestamp);
+/* returns -ENODATA until the first update after a reset */
+int audio_render_clock_next(const struct audio_render_clock *clock, int64_t *timestamp);
+
+#endif
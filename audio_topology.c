@@ -0,0 +1,176 @@
+#define LOG_TAG "audio_topology"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "audio_topology.h"
+
+#define SOUND_CARDS_PATH "/proc/asound/cards"
+#define SOUND_PCM_PATH "/proc/asound/pcm"
+
+static pthread_mutex_t topology_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct audio_topology_card topology_cards[TOPOLOGY_MAX_CARDS];
+static struct audio_topology_pcm topology_pcms[TOPOLOGY_MAX_PCMS];
+static int topology_card_count;
+static int topology_pcm_count;
+
+/* copy [start, end) into dst, dropping surrounding blanks */
+static void copy_trimmed(char *dst, size_t size, const char *start, const char *end)
+{
+    size_t len;
+
+    while (start < end && (*start == ' ' || *start == '\t'))
+        start++;
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n'))
+        end--;
+    len = end - start;
+    if (len >= size)
+        len = size - 1;
+    memcpy(dst, start, len);
+    dst[len] = '\0';
+}
+
+/*
+ * " 0 [AMLM8AUDIO     ]: AML-M8AUDIO - AML-M8AUDIO"
+ * Every card is followed by a long name line, which does not start with
+ * a number and is skipped.
+ */
+static int parse_cards(void)
+{
+    struct audio_topology_card *c;
+    char line[256];
+    char *open, *close, *dash;
+    FILE *fp;
+    int card;
+
+    fp = fopen(SOUND_CARDS_PATH, "r");
+    if (fp == NULL) {
+        ALOGE("cannot open %s: %d", SOUND_CARDS_PATH, errno);
+        return -errno;
+    }
+    topology_card_count = 0;
+    while (fgets(line, sizeof(line), fp) != NULL &&
+            topology_card_count < TOPOLOGY_MAX_CARDS) {
+        if (sscanf(line, " %d [", &card) != 1)
+            continue;
+        open = strchr(line, '[');
+        close = open ? strstr(open, "]:") : NULL;
+        if (close == NULL)
+            continue;
+        c = &topology_cards[topology_card_count++];
+        c->card = card;
+        copy_trimmed(c->id, sizeof(c->id), open + 1, close);
+        dash = strstr(close + 2, " - ");
+        if (dash != NULL) {
+            copy_trimmed(c->driver, sizeof(c->driver), close + 2, dash);
+            copy_trimmed(c->name, sizeof(c->name), dash + 3, line + strlen(line));
+        } else {
+            copy_trimmed(c->driver, sizeof(c->driver), close + 2, line + strlen(line));
+            c->name[0] = '\0';
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* "00-01: id : name : playback 1 : capture 1" */
+static int parse_pcms(void)
+{
+    struct audio_topology_pcm *p;
+    char line[256];
+    char *field[5];
+    int card, device, n;
+    FILE *fp;
+
+    fp = fopen(SOUND_PCM_PATH, "r");
+    if (fp == NULL) {
+        ALOGE("cannot open %s: %d", SOUND_PCM_PATH, errno);
+        return -errno;
+    }
+    topology_pcm_count = 0;
+    while (fgets(line, sizeof(line), fp) != NULL &&
+            topology_pcm_count < TOPOLOGY_MAX_PCMS) {
+        if (sscanf(line, "%d-%d:", &card, &device) != 2)
+            continue;
+        field[0] = strchr(line, ':') + 1;
+        for (n = 1; n < 5; n++) {
+            field[n] = strstr(field[n - 1], " : ");
+            if (field[n] == NULL)
+                break;
+            field[n] += 3;
+        }
+        if (n < 2)
+            continue;
+        p = &topology_pcms[topology_pcm_count++];
+        p->card = card;
+        p->device = device;
+        copy_trimmed(p->id, sizeof(p->id), field[0], field[1] - 3);
+        copy_trimmed(p->name, sizeof(p->name), field[1],
+                n > 2 ? field[2] - 3 : line + strlen(line));
+        p->playback = p->capture = false;
+        for (n = 2; n < 5 && field[n] != NULL; n++) {
+            if (strncmp(field[n], "playback", 8) == 0)
+                p->playback = true;
+            else if (strncmp(field[n], "capture", 7) == 0)
+                p->capture = true;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int audio_topology_refresh(void)
+{
+    int ret;
+
+    pthread_mutex_lock(&topology_lock);
+    ret = parse_cards();
+    if (ret == 0)
+        ret = parse_pcms();
+    ALOGD("topology: %d cards, %d pcms", topology_card_count, topology_pcm_count);
+    pthread_mutex_unlock(&topology_lock);
+    return ret;
+}
+
+int audio_topology_find_card(const char *match)
+{
+    struct audio_topology_card *c;
+    int card = -ENODEV;
+    int i;
+
+    pthread_mutex_lock(&topology_lock);
+    for (i = 0; i < topology_card_count; i++) {
+        c = &topology_cards[i];
+        if (strstr(c->id, match) || strstr(c->driver, match) || strstr(c->name, match)) {
+            card = c->card;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&topology_lock);
+    return card;
+}
+
+int audio_topology_find_pcm(int card, const char *match, bool capture)
+{
+    struct audio_topology_pcm *p;
+    int device = -ENODEV;
+    int i;
+
+    pthread_mutex_lock(&topology_lock);
+    for (i = 0; i < topology_pcm_count; i++) {
+        p = &topology_pcms[i];
+        if (p->card != card || !(capture ? p->capture : p->playback))
+            continue;
+        if (strstr(p->id, match) || strstr(p->name, match)) {
+            device = p->device;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&topology_lock);
+    return device;
+}
@@ -0,0 +1,40 @@
+#ifndef __AUDIO_TOPOLOGY_H__
+#define __AUDIO_TOPOLOGY_H__
+
+#include <stdbool.h>
+
+/*
+ * Index of the ALSA cards and pcm devices in /proc/asound, built once at
+ * adev_open() and rebuilt by audio_topology_refresh() on hotplug, so that
+ * stream start only has to search a table.
+ */
+#define TOPOLOGY_MAX_CARDS 8
+#define TOPOLOGY_MAX_PCMS 32
+
+struct audio_topology_card {
+    int card;
+    char id[16];
+    char driver[32];
+    char name[80];
+};
+
+struct audio_topology_pcm {
+    int card;
+    int device;
+    char id[64];
+    char name[64];
+    bool playback;
+    bool capture;
+};
+
+/* re-read /proc/asound/cards and /proc/asound/pcm, returns 0 or -errno */
+int audio_topology_refresh(void);
+/* lowest card whose id, driver or name contains match, -ENODEV if none */
+int audio_topology_find_card(const char *match);
+/*
+ * lowest device on card whose id or name contains match and that can
+ * capture (or play back, when capture is false), -ENODEV if none
+ */
+int audio_topology_find_pcm(int card, const char *match, bool capture);
+
+#endif
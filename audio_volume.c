@@ -0,0 +1,217 @@
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define VOLUME_NEON 1
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define VOLUME_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include <string.h>
+
+#include "audio_volume.h"
+
+#define VOLUME_UNITY (1 << 30)
+/* a ramp taken through audio_volume_get() moves in this many steps */
+#define VOLUME_GET_STEPS 8
+/* the sample loops multiply by Q14 gains, which fit in 16 bits */
+#define VOLUME_Q14(gain) ((int16_t)((gain) >> 16))
+
+static int32_t volume_to_q30(float volume)
+{
+    if (!(volume > 0.0f))
+        return 0;
+    if (volume >= 1.0f)
+        return VOLUME_UNITY;
+    return (int32_t)(volume * VOLUME_UNITY);
+}
+
+void audio_volume_init(struct audio_volume *vol, unsigned int rate)
+{
+    vol->gain[0] = vol->gain[1] = VOLUME_UNITY;
+    vol->target[0] = vol->target[1] = VOLUME_UNITY;
+    vol->step[0] = vol->step[1] = 0;
+    vol->ramp_frames = rate * VOLUME_RAMP_MS / 1000;
+    if (vol->ramp_frames == 0)
+        vol->ramp_frames = 1;
+    vol->ramp_left = 0;
+}
+
+void audio_volume_set(struct audio_volume *vol, float left, float right)
+{
+    int c;
+
+    vol->target[0] = volume_to_q30(left);
+    vol->target[1] = volume_to_q30(right);
+    if (vol->target[0] == vol->gain[0] && vol->target[1] == vol->gain[1]) {
+        vol->ramp_left = 0;
+        return;
+    }
+    /* a ramp in progress restarts from where it got to */
+    for (c = 0; c < 2; c++)
+        vol->step[c] = (vol->target[c] - vol->gain[c]) / (int32_t)vol->ramp_frames;
+    vol->ramp_left = vol->ramp_frames;
+}
+
+bool audio_volume_is_unity(const struct audio_volume *vol)
+{
+    return vol->ramp_left == 0 &&
+            vol->gain[0] == VOLUME_UNITY && vol->gain[1] == VOLUME_UNITY;
+}
+
+/* one gain step per frame, returns how many frames were ramped */
+static size_t volume_ramp(struct audio_volume *vol, const int16_t *src, int16_t *dst16,
+        int32_t *dst32, size_t frames, unsigned int channels)
+{
+    size_t n = frames < vol->ramp_left ? frames : vol->ramp_left;
+    int16_t g[2];
+    size_t f;
+    unsigned int c;
+    int32_t p;
+
+    for (f = 0; f < n; f++) {
+        vol->gain[0] += vol->step[0];
+        vol->gain[1] += vol->step[1];
+        g[0] = VOLUME_Q14(vol->gain[0]);
+        g[1] = channels == 1 ? g[0] : VOLUME_Q14(vol->gain[1]);
+        for (c = 0; c < channels; c++) {
+            p = *src++ * g[c & 1];
+            if (dst32 != NULL)
+                *dst32++ = p << 2;
+            else
+                *dst16++ = p >> 14;
+        }
+    }
+    vol->ramp_left -= n;
+    if (vol->ramp_left == 0) {
+        /* drop the rounding left over from the steps */
+        vol->gain[0] = vol->target[0];
+        vol->gain[1] = vol->target[1];
+    }
+    return n;
+}
+
+/* the steady gains, repeated for eight lanes */
+static void volume_lanes(const struct audio_volume *vol, unsigned int channels, int16_t *g)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        g[i] = VOLUME_Q14(vol->gain[channels == 1 ? 0 : i & 1]);
+}
+
+void audio_volume_apply(struct audio_volume *vol, const int16_t *src, int16_t *dst,
+        size_t frames, unsigned int channels)
+{
+    size_t i, samples;
+    int16_t g[8];
+
+    i = volume_ramp(vol, src, dst, NULL, frames, channels) * channels;
+    samples = frames * channels;
+    if (audio_volume_is_unity(vol)) {
+        if (dst != src)
+            memcpy(dst + i, src + i, (samples - i) * sizeof(int16_t));
+        return;
+    }
+    volume_lanes(vol, channels, g);
+
+#if defined(VOLUME_NEON)
+    {
+        int16x4_t gv = vld1_s16(g);
+        int16x8_t s;
+
+        for (; i + 8 <= samples; i += 8) {
+            s = vld1q_s16(src + i);
+            vst1q_s16(dst + i, vcombine_s16(
+                    vshrn_n_s32(vmull_s16(vget_low_s16(s), gv), 14),
+                    vshrn_n_s32(vmull_s16(vget_high_s16(s), gv), 14)));
+        }
+    }
+#elif defined(VOLUME_SSE2)
+    {
+        __m128i gv = _mm_loadu_si128((const __m128i *)g);
+        __m128i s, lo, hi;
+
+        for (; i + 8 <= samples; i += 8) {
+            s = _mm_loadu_si128((const __m128i *)(src + i));
+            lo = _mm_mullo_epi16(s, gv);
+            hi = _mm_mulhi_epi16(s, gv);
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(
+                    _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 14),
+                    _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 14)));
+        }
+    }
+#endif
+    /* with even channel counts, the parity of a sample is that of its channel */
+    for (; i < samples; i++)
+        dst[i] = (src[i] * g[(channels == 1 ? 0 : i & 1)]) >> 14;
+}
+
+void audio_volume_apply_s32(struct audio_volume *vol, const int16_t *src, int32_t *dst,
+        size_t frames, unsigned int channels)
+{
+    size_t i, samples;
+    int16_t g[8];
+
+    i = volume_ramp(vol, src, NULL, dst, frames, channels) * channels;
+    samples = frames * channels;
+    volume_lanes(vol, channels, g);
+
+#if defined(VOLUME_NEON)
+    {
+        int16x4_t gv = vld1_s16(g);
+        int16x8_t s;
+
+        for (; i + 8 <= samples; i += 8) {
+            s = vld1q_s16(src + i);
+            vst1q_s32(dst + i, vshlq_n_s32(vmull_s16(vget_low_s16(s), gv), 2));
+            vst1q_s32(dst + i + 4, vshlq_n_s32(vmull_s16(vget_high_s16(s), gv), 2));
+        }
+    }
+#elif defined(VOLUME_SSE2)
+    {
+        __m128i gv = _mm_loadu_si128((const __m128i *)g);
+        __m128i s, lo, hi;
+
+        for (; i + 8 <= samples; i += 8) {
+            s = _mm_loadu_si128((const __m128i *)(src + i));
+            lo = _mm_mullo_epi16(s, gv);
+            hi = _mm_mulhi_epi16(s, gv);
+            _mm_storeu_si128((__m128i *)(dst + i),
+                    _mm_slli_epi32(_mm_unpacklo_epi16(lo, hi), 2));
+            _mm_storeu_si128((__m128i *)(dst + i + 4),
+                    _mm_slli_epi32(_mm_unpackhi_epi16(lo, hi), 2));
+        }
+    }
+#endif
+    /* unity comes out as the plain << 16 widening */
+    for (; i < samples; i++)
+        dst[i] = (src[i] * g[(channels == 1 ? 0 : i & 1)]) << 2;
+}
+
+size_t audio_volume_get(const struct audio_volume *vol, float *left, float *right)
+{
+    size_t n = vol->ramp_frames / VOLUME_GET_STEPS;
+
+    *left = (float)vol->gain[0] / VOLUME_UNITY;
+    *right = (float)vol->gain[1] / VOLUME_UNITY;
+    if (vol->ramp_left == 0)
+        return SIZE_MAX;
+    if (n == 0)
+        n = 1;
+    return n < vol->ramp_left ? n : vol->ramp_left;
+}
+
+void audio_volume_advance(struct audio_volume *vol, size_t frames)
+{
+    size_t n = frames < vol->ramp_left ? frames : vol->ramp_left;
+
+    if (n == 0)
+        return;
+    vol->gain[0] += vol->step[0] * (int32_t)n;
+    vol->gain[1] += vol->step[1] * (int32_t)n;
+    vol->ramp_left -= n;
+    if (vol->ramp_left == 0) {
+        vol->gain[0] = vol->target[0];
+        vol->gain[1] = vol->target[1];
+    }
+}
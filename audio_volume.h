@@ -0,0 +1,45 @@
+#ifndef __AUDIO_VOLUME_H__
+#define __AUDIO_VOLUME_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-stream software volume. A new volume is reached through a linear
+ * ramp of VOLUME_RAMP_MS, one step per frame, so that it does not zipper.
+ * Even channels take the left gain and odd channels the right one; mono
+ * takes the left gain. Gains are clamped to [0, 1].
+ */
+#define VOLUME_RAMP_MS 10
+
+struct audio_volume {
+    int32_t gain[2];            /* left, right; Q30, 1 << 30 is unity */
+    int32_t target[2];
+    int32_t step[2];            /* added per frame while ramping */
+    unsigned int ramp_frames;   /* length of a full ramp */
+    unsigned int ramp_left;
+};
+
+void audio_volume_init(struct audio_volume *vol, unsigned int rate);
+void audio_volume_set(struct audio_volume *vol, float left, float right);
+/* true when applying the volume would not change anything */
+bool audio_volume_is_unity(const struct audio_volume *vol);
+
+/* channels is 1 or even, dst may be src */
+void audio_volume_apply(struct audio_volume *vol, const int16_t *src, int16_t *dst,
+        size_t frames, unsigned int channels);
+/* same, widening to 32 bits in the same pass: dst may not alias src */
+void audio_volume_apply_s32(struct audio_volume *vol, const int16_t *src, int32_t *dst,
+        size_t frames, unsigned int channels);
+
+/*
+ * For a gain applied elsewhere, such as in a mix matrix: the left and right
+ * gains to use now, and for how many frames at most. A ramp then moves in
+ * a few steps instead of one per frame, as audio_volume_advance() is told
+ * how far the stream got.
+ */
+size_t audio_volume_get(const struct audio_volume *vol, float *left, float *right);
+void audio_volume_advance(struct audio_volume *vol, size_t frames);
+
+#endif
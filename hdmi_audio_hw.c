@@ -45,6 +45,12 @@
 #include <hardware/audio_effect.h>
 #include <audio_effects/effect_aec.h>
 
+#include "audio_mmap.h"
+#include "audio_props.h"
+#include "audio_timestamp.h"
+#include "audio_topology.h"
+#include "audio_volume.h"
+
 /* ALSA cards for AML */
 #define CARD_AMLOGIC_BOARD 0 
 #define CARD_AMLOGIC_USB 1
@@ -75,6 +81,9 @@ static unsigned int  DEFAULT_OUT_SAMPLING_RATE  = 44100;
 
 static unsigned int first_write_status;
 
+/* open the pcm with PCM_MMAP | PCM_NOIRQ and write into the DMA buffer */
+#define MMAP_PLAYBACK_PROPERTY "media.audio.mmap_playback"
+
 
 struct pcm_config pcm_config_out = {
     .channels = 2,
@@ -127,6 +136,13 @@ struct aml_stream_out {
     int write_threshold;
     bool low_power;
 	unsigned   multich;	
+    struct audio_mmap mmap;
+    struct audio_volume volume;
+    int16_t *volume_buf;        /* the scaled write, the caller's buffer is const */
+    size_t volume_buf_size;     /* in bytes */
+    bool bitstream;             /* digital_codec passthrough, never scaled */
+    uint64_t frames_written;    /* stream frames, kept across standby */
+    struct audio_render_clock render_clock;
 };
 
 typedef struct hdmi_stream_state{
@@ -274,11 +290,8 @@ float computeVolume(struct audio_stream_in *stream)
 {
     struct aml_stream_in *in = (struct aml_stream_in *)stream;
     float volume = 1.0f;
-    char prop[PROPERTY_VALUE_MAX];
-    
-    property_get("mbx.hdmiin.vol",prop,"15");
-    
-    int indexUI = atoi(prop);
+    int indexUI = audio_props_get()->hdmiin_vol;
+
     if(indexUI > in->indexMax)
         indexUI = in->indexMax;
     else if(indexUI < in->indexMIn)
@@ -441,73 +454,13 @@ static int check_output_stream(struct aml_stream_out *out)
     return 0;
 }
 
+/* card and port lookups go through the index built at adev_open() */
 static int  get_aml_card(){
-	int card = -1, err = 0;
-	int fd = -1;
-	unsigned fileSize = 512;
-	char *read_buf = NULL, *pd = NULL;
-	static const char *const SOUND_CARDS_PATH = "/proc/asound/cards";
-	fd = open(SOUND_CARDS_PATH, O_RDONLY);
-    if (fd < 0) {
-        ALOGE("ERROR: failed to open config file %s error: %d\n", SOUND_CARDS_PATH, errno);
-        close(fd);
-        return -EINVAL;
-    }
-
-	read_buf = (char *)malloc(fileSize);
-	if (!read_buf) {
-        ALOGE("Failed to malloc read_buf");
-        close(fd);
-        return -ENOMEM;
-    }
-	memset(read_buf, 0x0, fileSize);
-	err = read(fd, read_buf, fileSize);
-	if (fd < 0) {
-        ALOGE("ERROR: failed to read config file %s error: %d\n", SOUND_CARDS_PATH, errno);
-        close(fd);
-        return -EINVAL;
-    }
-	pd = strstr(read_buf, "AML");
-	card = *(pd - 3) - '0';
-
-OUT:
-	free(read_buf);
-	close(fd);
-	return card;
-}
-static int get_spdif_port(){
-	int port = -1, err = 0;
-	int fd = -1;
-	unsigned fileSize = 512;
-	char *read_buf = NULL, *pd = NULL;
-	static const char *const SOUND_PCM_PATH = "/proc/asound/pcm";
-	fd = open(SOUND_PCM_PATH, O_RDONLY);
-    if (fd < 0) {
-        ALOGE("ERROR: failed to open config file %s error: %d\n", SOUND_PCM_PATH, errno);
-        close(fd);
-        return -EINVAL;
-    }
-
-	read_buf = (char *)malloc(fileSize);
-	if (!read_buf) {
-        ALOGE("Failed to malloc read_buf");
-        close(fd);
-        return -ENOMEM;
-    }
-	memset(read_buf, 0x0, fileSize);
-	err = read(fd, read_buf, fileSize);
-	if (fd < 0) {
-        ALOGE("ERROR: failed to read config file %s error: %d\n", SOUND_PCM_PATH, errno);
-        close(fd);
-        return -EINVAL;
-    }
-	pd = strstr(read_buf, "SPDIF");
-	port = *(pd -3) - '0';
+    return audio_topology_find_card("AML");
+}
 
-OUT:
-	free(read_buf);
-	close(fd);
-	return port;
+static int get_spdif_port(int card){
+    return audio_topology_find_pcm(card, "SPDIF", false);
 }
 /* must be called with hw device and output stream mutexes locked */
 static int start_output_stream(struct aml_stream_out *out)
@@ -530,10 +483,10 @@ static int start_output_stream(struct aml_stream_out *out)
     	 ALOGE("hdmi get aml card id failed \n");
 	 card = 	 CARD_AMLOGIC_DEFAULT;
     }
-    port = get_spdif_port();
+    port = get_spdif_port(card);
     if(port < 0 ){
     	 ALOGE("hdmi get aml card port  failed \n");
-	 card = 	 PORT_MM;
+	 port = 	 PORT_MM;
     }	
     ALOGI("hdmi sound card id %d,device id %d \n",card,port);	
     if(out->config.channels == 8){
@@ -543,13 +496,14 @@ static int start_output_stream(struct aml_stream_out *out)
         ALOGI("[%s %d]8CH format output: set port/0 adev->out_device/%d\n",__FUNCTION__,__LINE__,AUDIO_DEVICE_OUT_SPEAKER);
     }
     LOGFUNC("------------open on board audio-------");
-    if(getprop_bool("media.libplayer.wfd")){
+    if(audio_props_get()->wfd){
         out->config.period_size = PERIOD_SIZE;     
     }
     /* default to low power: will be corrected in out_write if necessary before first write to
      * tinyalsa.
      */
     int codec_type=get_codec_type("/sys/class/audiodsp/digital_codec");
+    out->bitstream = codec_type != 0;
     if(codec_type == 4 || codec_type == 5){
         out->config.period_size=PERIOD_SIZE*2;
         out->write_threshold = PLAYBACK_PERIOD_COUNT * PERIOD_SIZE*2;
@@ -582,6 +536,7 @@ static int start_output_stream(struct aml_stream_out *out)
                   {
                         pcm_close(pLastStreamOut->pcm);
                         pLastStreamOut->pcm = NULL;
+                        pLastStreamOut->mmap.pcm = NULL;
                         adev_local->active_output = 0;
                         if (pLastStreamOut->echo_reference != NULL) {
                             pLastStreamOut->echo_reference->write(pLastStreamOut->echo_reference, NULL);
@@ -630,7 +585,20 @@ static int start_output_stream(struct aml_stream_out *out)
 	ALOGI("channels=%d---format=%d---period_count%d---period_size%d---rate=%d---",
 		                 out->config.channels, out->config.format, out->config.period_count, 
 		                 out->config.period_size, out->config.rate);
-    out->pcm = pcm_open(card, port, PCM_OUT /*| PCM_MMAP | PCM_NOIRQ*/, &(out->config));
+    out->mmap.pcm = NULL;
+    out->pcm = NULL;
+    if (getprop_bool(MMAP_PLAYBACK_PROPERTY)) {
+        out->pcm = pcm_open(card, port, PCM_OUT | PCM_MMAP | PCM_NOIRQ, &(out->config));
+        if (pcm_is_ready(out->pcm)) {
+            audio_mmap_init(&out->mmap, out->pcm, &out->config);
+        } else {
+            ALOGW("cannot open pcm_out for mmap: %s", pcm_get_error(out->pcm));
+            pcm_close(out->pcm);
+            out->pcm = NULL;
+        }
+    }
+    if (out->pcm == NULL)
+        out->pcm = pcm_open(card, port, PCM_OUT, &(out->config));
     if (!pcm_is_ready(out->pcm)) {
         ALOGE("cannot open pcm_out driver: %s", pcm_get_error(out->pcm));
         pcm_close(out->pcm);
@@ -771,12 +739,15 @@ static int get_playback_delay(struct aml_stream_out *out,
      * Add the duration of current frame as we want the render time of the last
      * sample being written. */
     buffer->delay_ns = (long)(((int64_t)(kernel_frames + frames)* 1000000000)/
-                            DEFAULT_OUT_SAMPLING_RATE);
-
-	ALOGV("get_playback_delay time_stamp = [%ld].[%ld], delay_ns: [%d],"
-		 "kernel_frames:[%d]",
-	 	buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, buffer->delay_ns,
-	 	kernel_frames);
+                            out->config.rate);
+    /* plus what the resampler holds back before it reaches the driver */
+    if (out->resampler && out->config.rate != DEFAULT_OUT_SAMPLING_RATE)
+        buffer->delay_ns += out->resampler->delay_ns(out->resampler);
+
+    ALOGV("get_playback_delay time_stamp = [%ld].[%ld], delay_ns: [%d],"
+          "kernel_frames:[%d]",
+          buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, buffer->delay_ns,
+          kernel_frames);
     return 0;
 }
 
@@ -858,9 +829,11 @@ static int do_output_standby(struct aml_stream_out *out)
        HdmiStreamState.N8ch_out_flag=0;
     }
     pthread_mutex_unlock(&HdmiStreamState.hdmi_state_mutex);
+    audio_render_clock_reset(&out->render_clock, DEFAULT_OUT_SAMPLING_RATE);
     if (!out->standby) {
         pcm_close(out->pcm);
         out->pcm = NULL;
+        out->mmap.pcm = NULL;
 
         adev->active_output = 0;
 
@@ -942,6 +915,8 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
             }
             adev->out_device &= ~AUDIO_DEVICE_OUT_ALL;
             adev->out_device |= val;
+            /* device changes follow hotplug, pick up added or removed pcms */
+            audio_topology_refresh();
             select_output_device(adev);
         }
         pthread_mutex_unlock(&out->lock);
@@ -1021,10 +996,91 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
 }
 
 
+/*
+ * Stream frames written but not played yet, in the driver and in the
+ * resampler, with the time that was measured at.
+ * must be called with the output stream and hdmi state mutexes locked: another
+ * stream's start_output_stream() closes out->pcm holding only the latter
+ */
+static int out_get_held_frames(struct aml_stream_out *out, uint64_t *held,
+                               struct timespec *timestamp)
+{
+    unsigned int queued;
+    int64_t frames;
+
+    if (out->pcm == NULL || audio_pcm_queued(out->pcm, &queued, timestamp) != 0)
+        return -ENODATA;
+    /* device frames back to stream frames */
+    frames = (int64_t)queued * DEFAULT_OUT_SAMPLING_RATE / out->config.rate;
+    if (out->resampler && out->config.rate != DEFAULT_OUT_SAMPLING_RATE)
+        frames += (int64_t)out->resampler->delay_ns(out->resampler) *
+                DEFAULT_OUT_SAMPLING_RATE / 1000000000;
+    *held = frames > 0 ? frames : 0;
+    return 0;
+}
+
 static int out_set_volume(struct audio_stream_out *stream, float left,
                           float right)
 {
-    return -ENOSYS;
+    struct aml_stream_out *out = (struct aml_stream_out *)stream;
+    int ret = 0;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->bitstream)
+        ret = -ENOSYS;
+    else
+        audio_volume_set(&out->volume, left, right);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+struct out_mmap_source {
+    struct aml_stream_out *out;
+    int16_t *data;
+    size_t frames;
+};
+
+/* resample, widen to 32 bits for 8ch or copy, straight into the DMA buffer */
+static bool out_mmap_fill(void *cookie, void *dst, unsigned int *frames)
+{
+    struct out_mmap_source *src = (struct out_mmap_source *)cookie;
+    struct aml_stream_out *out = src->out;
+    size_t in_frames = src->frames;
+    size_t out_frames = *frames;
+    size_t i;
+
+    if (out->config.rate != DEFAULT_OUT_SAMPLING_RATE) {
+        out->resampler->resample_from_input(out->resampler,
+                                            src->data, &in_frames,
+                                            (int16_t *)dst, &out_frames);
+    } else {
+        if (out_frames > in_frames)
+            out_frames = in_frames;
+        in_frames = out_frames;
+        if (out->config.channels == 8 && !out->bitstream) {
+            audio_volume_apply_s32(&out->volume, src->data, (int32_t *)dst, out_frames, 8);
+        } else if (out->config.channels == 8) {
+            int32_t *p32 = (int32_t *)dst;
+            for (i = 0; i < out_frames * 8; i++)
+                p32[i] = src->data[i] << 16;
+        } else {
+            memcpy(dst, src->data, pcm_frames_to_bytes(out->pcm, out_frames));
+        }
+    }
+    src->data += in_frames * out->config.channels;
+    src->frames -= in_frames;
+    *frames = out_frames;
+    return src->frames > 0;
+}
+
+static int out_write_mmap(struct aml_stream_out *out, const void *buffer, size_t frames)
+{
+    struct out_mmap_source src;
+
+    src.out = out;
+    src.data = (int16_t *)buffer;
+    src.frames = frames;
+    return audio_mmap_write(&out->mmap, out_mmap_fill, &src);
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -1048,16 +1104,18 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 		volatile char *data_src;
 		short *dataprint;
 		uint i, total_len;
-        char prop[PROPERTY_VALUE_MAX];
+		bool dev_locked = false;
 	
-		/* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-		 * on the output stream mutex - e.g. executing select_mode() while holding the hw device
-		 * mutex
+		/* the steady state only needs the stream; standby transitions also need
+		 * the hw device mutex, which comes first in lock order
 		 */
-        
-
-		pthread_mutex_lock(&adev->lock);
 		pthread_mutex_lock(&out->lock);
+		if (out->standby || (audio_props_get()->multichannel && out->config.channels != 8)) {
+			pthread_mutex_unlock(&out->lock);
+			pthread_mutex_lock(&adev->lock);
+			pthread_mutex_lock(&out->lock);
+			dev_locked = true;
+		}
 
         if(!HdmiStreamState.init_flag){
              HdmiStreamState.init_flag=1;
@@ -1065,26 +1123,37 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
              ALOGI("[%s %d]HdmiStreamState.hdmi_state_mutex init finised!\n",__FUNCTION__,__LINE__);
         }
         pthread_mutex_lock(&HdmiStreamState.hdmi_state_mutex);
+        /* another stream's start_output_stream() may have forced this one into
+         * standby before the state mutex was held: start over in lock order
+         */
+        if (!dev_locked &&
+                (out->standby || (audio_props_get()->multichannel && out->config.channels != 8))) {
+            pthread_mutex_unlock(&HdmiStreamState.hdmi_state_mutex);
+            pthread_mutex_unlock(&out->lock);
+            pthread_mutex_lock(&adev->lock);
+            pthread_mutex_lock(&out->lock);
+            pthread_mutex_lock(&HdmiStreamState.hdmi_state_mutex);
+            dev_locked = true;
+        }
 
         if(HdmiStreamState.LastStreamInUse && 
            HdmiStreamState.LastStreamDirectFlag && 
            out!= HdmiStreamState.pLastStreamOut)
         { 
             ret=0;
-            pthread_mutex_unlock(&adev->lock);
+            if (dev_locked)
+                pthread_mutex_unlock(&adev->lock);
             goto exit;
         }
         //-----------8CH PCM judge-----------
         #if 1
-        #define DOLBY_SYSTEM_CHANNEL "ds1.audio.multichannel.support"
-        char value[128]={0};
-        property_get(DOLBY_SYSTEM_CHANNEL,value,NULL);
-        if((!strcmp(value,"true") ||!strcmp(value,"1")) && out->config.channels!=8)
+        if(audio_props_get()->multichannel && out->config.channels!=8)
         {     
             if (!out->standby) {
                    ALOGI("[%s %d]8ch PCM output,standby other outputs/%p...\n",__FUNCTION__,__LINE__,out);
                    pcm_close(out->pcm);
                    out->pcm = NULL;
+                   out->mmap.pcm = NULL;
                    adev->active_output = 0;
                    if (out->echo_reference != NULL) {/* stop writing to echo reference */
                        out->echo_reference->write(out->echo_reference, NULL);
@@ -1092,7 +1161,8 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                    }
                    out->standby = 1;
               }
-              pthread_mutex_unlock(&adev->lock);
+              if (dev_locked)
+                  pthread_mutex_unlock(&adev->lock);
               goto exit;
         }
         #endif
@@ -1100,7 +1170,8 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 		if (out->standby) {
 			ret = start_output_stream(out);
 			if (ret != 0) {
-				pthread_mutex_unlock(&adev->lock);
+				if (dev_locked)
+					pthread_mutex_unlock(&adev->lock);
 				goto exit;
 			}
 			out->standby = 0;
@@ -1110,7 +1181,28 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 					adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
 				force_input_standby = true;
 		}
-		pthread_mutex_unlock(&adev->lock);
+		if (dev_locked)
+			pthread_mutex_unlock(&adev->lock);
+
+		/* 8ch is scaled while it is widened below */
+		if (!out->bitstream && out->config.channels != 8 &&
+				!audio_volume_is_unity(&out->volume)) {
+			if (out->volume_buf_size < bytes) {
+				int16_t *volume_buf = realloc(out->volume_buf, bytes);
+
+				if (volume_buf != NULL) {
+					out->volume_buf = volume_buf;
+					out->volume_buf_size = bytes;
+				}
+			}
+			if (out->volume_buf_size >= bytes) {
+				audio_volume_apply(&out->volume, buffer, out->volume_buf, in_frames,
+						frame_size / sizeof(int16_t));
+				buffer = out->volume_buf;
+			} else {
+				ALOGW("no memory to apply the volume, writing unscaled");
+			}
+		}
 
 		/* only use resampler if required */
 		if (out->config.rate != DEFAULT_OUT_SAMPLING_RATE) {
@@ -1130,11 +1222,16 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 	                goto exit;
 	            }
 	        }
-			out->resampler->resample_from_input(out->resampler,
-												(int16_t *)buffer,
-												&in_frames,
-												(int16_t *)out->buffer,
-												&out_frames);
+			if (out->mmap.pcm != NULL) {
+				/* resampled straight into the DMA buffer below */
+				out_frames = in_frames * out->config.rate / DEFAULT_OUT_SAMPLING_RATE;
+			} else {
+				out->resampler->resample_from_input(out->resampler,
+													(int16_t *)buffer,
+													&in_frames,
+													(int16_t *)out->buffer,
+													&out_frames);
+			}
 			buf = out->buffer;
 		} else {
 			out_frames = in_frames;
@@ -1159,7 +1256,11 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         }
 #endif
 
-	if(out->config.rate != DEFAULT_OUT_SAMPLING_RATE) {
+	if(out->config.rate != DEFAULT_OUT_SAMPLING_RATE && out->mmap.pcm != NULL) {
+		/* mmap commits any number of frames, no 64-byte chunking needed */
+		if(!out->standby)
+			ret = out_write_mmap(out, buffer, in_frames);
+	}else if(out->config.rate != DEFAULT_OUT_SAMPLING_RATE) {
 		total_len = out_frames*frame_size + cached_len;
 
 
@@ -1192,9 +1293,8 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 		ret = pcm_write(out->pcm, (void *)output_buffer_bytes, ouput_len);
 	}else{
         if(!out->standby){
-            property_get("sys.hdmiIn.Capture",prop,"false");
             // ALOGD("****first_write_status=%d***",first_write_status);
-            if(!strcmp(prop,"true")){
+            if(audio_props_get()->hdmiin_capture){
                 if(first_write_status < 20){
                    first_write_status = first_write_status + 1;
                    memset((char*)buf,0,bytes);
@@ -1202,7 +1302,10 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
             }else{
                 first_write_status = 0;
             }
-            if(out->config.channels==8){
+            if(out->mmap.pcm != NULL){
+                ret = out_write_mmap(out, buf, out_frames);
+            }
+            else if(out->config.channels==8){
                 int *p32=NULL;
                 short *p16=(short*)buf;
                 int i,NumSamps;
@@ -1210,9 +1313,13 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                 p32=malloc(NumSamps*sizeof(int));
                 if(p32!=NULL)
                 {  
-                    for(i=0;i<NumSamps;i++)//suppose 16bit/8ch PCM
-                    { 
-                        p32[i]=p16[i]<<16;
+                    if(!out->bitstream){
+                        audio_volume_apply_s32(&out->volume, p16, p32, out_frames, 8);
+                    }else{
+                        for(i=0;i<NumSamps;i++)//suppose 16bit/8ch PCM
+                        { 
+                            p32[i]=p16[i]<<16;
+                        }
                     }
                     ret=pcm_write(out->pcm, (void *)p32, NumSamps*4);
                     free(p32);
@@ -1220,9 +1327,16 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
             }
             else
                 ret = pcm_write(out->pcm, (void *)buf, out_frames * frame_size);
-                //ret = pcm_mmap_write(out->pcm, (void *)buf, out_frames * frame_size);
         }
 	}
+	if (ret == 0) {
+		struct timespec ts;
+		uint64_t held;
+
+		out->frames_written += bytes / frame_size;
+		if (out_get_held_frames(out, &held, &ts) == 0)
+			audio_render_clock_update(&out->render_clock, bytes / frame_size, held, &ts);
+	}
 
 
 	exit:
@@ -1255,6 +1369,23 @@ static int out_get_render_position(const struct audio_stream_out *stream,
     return -EINVAL;
 }
 
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp)
+{
+    struct aml_stream_out *out = (struct aml_stream_out *)stream;
+    uint64_t held;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    pthread_mutex_lock(&HdmiStreamState.hdmi_state_mutex);
+    ret = out_get_held_frames(out, &held, timestamp);
+    if (ret == 0)
+        *frames = held < out->frames_written ? out->frames_written - held : 0;
+    pthread_mutex_unlock(&HdmiStreamState.hdmi_state_mutex);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
     LOGFUNC("%s(%p, %p)", __FUNCTION__, stream, effect);
@@ -1268,7 +1399,15 @@ static int out_remove_audio_effect(const struct audio_stream *stream, effect_han
 static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
                                         int64_t *timestamp)
 {
-    return -EINVAL;
+    struct aml_stream_out *out = (struct aml_stream_out *)stream;
+    int ret = -ENODATA;
+
+    pthread_mutex_lock(&out->lock);
+    /* other streams can force this one into standby behind its back */
+    if (!out->standby)
+        ret = audio_render_clock_next(&out->render_clock, timestamp);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
 }
 
 static int get_next_buffer(struct resampler_buffer_provider *buffer_provider, 
@@ -1300,7 +1439,7 @@ static int start_input_stream(struct aml_stream_in *in)
 	ALOGV("%s(in->requested_rate=%d, in->config.rate=%d)", 
 		     __FUNCTION__, in->requested_rate, in->config.rate);
 
-    if(getprop_bool("media.libplayer.wfd")){
+    if(audio_props_get()->wfd){
         PERIOD_SIZE = DEFAULT_PERIOD_SIZE/2;
         in->config.period_size = PERIOD_SIZE;
     }
@@ -1880,18 +2019,21 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         usleep(sleepTime*1000);
         return bytes;
     }
-		/* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-		 * on the input stream mutex - e.g. executing select_mode() while holding the hw device
-		 * mutex
+		/* only starting the stream needs the hw device mutex, which comes first
+		 * in lock order
 		 */
-		pthread_mutex_lock(&adev->lock);
 		pthread_mutex_lock(&in->lock);
 		if (in->standby) {
-			ret = start_input_stream(in);
-			if (ret == 0)
-				in->standby = 0;
+			pthread_mutex_unlock(&in->lock);
+			pthread_mutex_lock(&adev->lock);
+			pthread_mutex_lock(&in->lock);
+			if (in->standby) {
+				ret = start_input_stream(in);
+				if (ret == 0)
+					in->standby = 0;
+			}
+			pthread_mutex_unlock(&adev->lock);
 		}
-		pthread_mutex_unlock(&adev->lock);
 
 		if (ret < 0)
 			goto exit;
@@ -2090,6 +2232,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.set_volume = out_set_volume;
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
+    out->stream.get_presentation_position = out_get_presentation_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
     out->config = pcm_config_out;
     dc = get_codec_type("/sys/class/audiodsp/digital_codec");
@@ -2104,6 +2247,9 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     }
     out->dev = ladev;
     out->standby = 1;
+    out->bitstream = dc != 0;
+    audio_volume_init(&out->volume, out->config.rate);
+    audio_render_clock_reset(&out->render_clock, DEFAULT_OUT_SAMPLING_RATE);
 
    /* FIXME: when we support multiple output devices, we will want to
       * do the following:
@@ -2146,6 +2292,7 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
         free(out->buffer);
     if (out->resampler)
         release_resampler(out->resampler);
+    free(out->volume_buf);
 
     free(stream);
 }
@@ -2429,6 +2576,10 @@ static int adev_open(const hw_module_t* module, const char* name,
     if (!adev)
         return -ENOMEM;
 
+    /* ds1/hdmiIn/wfd properties are read from a snapshot on the audio paths */
+    audio_props_start();
+    audio_topology_refresh();
+
     adev->hw_device.common.tag = HARDWARE_DEVICE_TAG;
     adev->hw_device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
     adev->hw_device.common.module = (struct hw_module_t *) module;
@@ -37,12 +37,17 @@
 #include <audio_utils/resampler.h>
 
 #include "audio_resampler.h"
+#include "audio_timestamp.h"
+#include "audio_topology.h"
+#include "audio_volume.h"
 
 #define DEFAULT_OUT_SAMPLING_RATE 44100
 #define RESAMPLER_BUFFER_SIZE 4096
 #define DEFAULT_PERIOD_SIZE  1024
 #define PERIOD_COUNT 4
 #define BUFFSIZE 100000
+/* linear (default), low, medium or high, see enum resample_quality */
+#define RESAMPLER_QUALITY_PROPERTY "media.audio.usb.resampler"
 
 struct pcm_config pcm_out_config = {
     .channels = 2,
@@ -81,8 +86,13 @@ struct aml_stream_out {
 	struct pcm_config out_config;
     struct pcm *out_pcm;
     struct resample_para resampler;
+    bool resampling;            /* out->resampler is in the path */
+    float mix_gain[2];          /* volume in the mix of out->resampler */
     void *buffer;
+    unsigned int buffer_frames; /* capacity of buffer, in device frames */
     bool standby;
+    struct audio_volume volume;
+    struct audio_render_clock render_clock;
 
     struct aml_audio_device *dev;
 };
@@ -273,6 +283,28 @@ static int get_usb_cap(char *type, uint *channels, uint *sampleRate, int card)
 
 /* Helper functions */
 
+/*
+ * Map the stereo stream to the device channels in out->resampler, with the
+ * stream volume folded into the matrix so that it costs no pass of its own.
+ */
+static void out_set_mix(struct aml_stream_out *out, float left, float right)
+{
+	float matrix[RESAMPLE_MAX_CHANNELS * 2] = { 0 };
+
+	if (out->out_config.channels == 1) {
+		/* mono devices get the L+R downmix */
+		matrix[0] = 0.5f * left;
+		matrix[1] = 0.5f * right;
+	} else {
+		/* front pair on the first two device channels, the rest silent */
+		matrix[0] = left;
+		matrix[3] = right;
+	}
+	resampler_set_mix(&out->resampler, pcm_out_config.channels, matrix, 1.0f);
+	out->mix_gain[0] = left;
+	out->mix_gain[1] = right;
+}
+
 /* must be called with hw device and output stream mutexes locked */
 static int start_output_stream(struct aml_stream_out *out)
 {
@@ -290,16 +322,36 @@ static int start_output_stream(struct aml_stream_out *out)
 		}
 	}
 	out->buffer = NULL;
-	if (out->out_config.rate != pcm_out_config.rate){
+	out->resampling = false;
+	/* the resampler also maps the stereo mix to the device channel layout */
+	if (out->out_config.rate != pcm_out_config.rate ||
+			out->out_config.channels != pcm_out_config.channels) {
 		out->resampler.input_sr = pcm_out_config.rate;
 		out->resampler.output_sr = out->out_config.rate;
 		out->resampler.channels = out->out_config.channels;
-		resampler_init(&out->resampler);
-		int buffersize = DEFAULT_PERIOD_SIZE * out->out_config.rate / pcm_out_config.rate + 1;
-		out->buffer = malloc(buffersize*4);
-		ALOGE("out->buffer: %p, buffer_size = %d",out->buffer,buffersize);
-		if (!out->buffer)
-			return -ENOMEM;
+		out->resampler.quality = RESAMPLE_QUALITY_LINEAR;
+		if (out->out_config.rate != pcm_out_config.rate) {
+			char quality[PROPERTY_VALUE_MAX];
+			property_get(RESAMPLER_QUALITY_PROPERTY, quality, "linear");
+			out->resampler.quality = resampler_quality_from_string(quality);
+		}
+		if (resampler_init(&out->resampler)) {
+			err = -EINVAL;
+			goto err;
+		}
+		out->resampling = true;
+		out_set_mix(out, 1.0f, 1.0f);
+		/* one period of output, out_write() resamples larger writes in chunks */
+		out->buffer_frames = resample_out_frames(&out->resampler, DEFAULT_PERIOD_SIZE);
+	} else {
+		/* where out_write() applies the volume, never to the caller's buffer */
+		out->buffer_frames = DEFAULT_PERIOD_SIZE;
+	}
+	out->buffer = malloc(out->buffer_frames * out->out_config.channels * sizeof(short));
+	ALOGE("out->buffer: %p, buffer_size = %d",out->buffer,out->buffer_frames);
+	if (!out->buffer) {
+		err = -ENOMEM;
+		goto err;
 	}
 
 	out->out_pcm = pcm_open(adev->card, adev->card_device, PCM_OUT, &out->out_config);
@@ -307,10 +359,20 @@ static int start_output_stream(struct aml_stream_out *out)
     if (!pcm_is_ready(out->out_pcm)) {
         ALOGE("pcm_open() failed: %s", pcm_get_error(out->out_pcm));
         pcm_close(out->out_pcm);
-		adev->active_output = NULL;
-        return -ENOMEM;
+        out->out_pcm = NULL;
+        err = -ENOMEM;
+        goto err;
     }
     return 0;
+
+err:
+    /* leave the stream as do_output_standby() would */
+    free(out->buffer);
+    out->buffer = NULL;
+    resampler_release(&out->resampler);
+    out->resampling = false;
+    adev->active_output = NULL;
+    return err;
 }
 
 /* API functions */
@@ -390,8 +452,10 @@ static int do_output_standby(struct aml_stream_out *out)
             free(out->buffer);
             out->buffer = NULL;
         }
+        resampler_release(&out->resampler);
         out->standby = true;
     }
+    audio_render_clock_reset(&out->render_clock, out_get_sample_rate(&out->stream.common));
     return 0;
 }
 
@@ -457,14 +521,47 @@ static char * out_get_parameters(const struct audio_stream *stream, const char *
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
 	struct aml_stream_out *out = (struct aml_stream_out *)stream;
-    return (pcm_out_config.period_size * pcm_out_config.period_count * 1000) /
+    uint32_t latency = (pcm_out_config.period_size * pcm_out_config.period_count * 1000) /
             out->out_config.rate;
+
+    /* group delay of the resampler, when one is in the path */
+    if (out->resampling)
+        latency += resample_delay_ns(&out->resampler) / 1000000;
+    return latency;
+}
+
+/*
+ * Stream frames written but not played yet, in the driver and in the
+ * resampler, with the time that was measured at.
+ * must be called with the output stream mutex locked
+ */
+static int out_get_held_frames(struct aml_stream_out *out, uint64_t *held,
+                               struct timespec *timestamp)
+{
+    uint32_t rate = out_get_sample_rate(&out->stream.common);
+    unsigned int queued;
+    int64_t frames;
+
+    if (out->out_pcm == NULL || audio_pcm_queued(out->out_pcm, &queued, timestamp) != 0)
+        return -ENODATA;
+    /* device frames back to stream frames */
+    frames = (int64_t)queued * rate / out->out_config.rate;
+    /* linear quality runs ahead of its input, a negative delay */
+    if (out->resampling)
+        frames += resample_delay_ns(&out->resampler) * rate / 1000000000;
+    *held = frames > 0 ? frames : 0;
+    return 0;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
                           float right)
 {
-    return -ENOSYS;
+    struct aml_stream_out *out = (struct aml_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    audio_volume_set(&out->volume, left, right);
+    pthread_mutex_unlock(&out->lock);
+    return 0;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -481,16 +578,25 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 		//struct aml_stream_in *in;
 		int kernel_frames;
 		void *buf;
+		const short *src = buffer;
    // ALOGD("*****out_write**device=0x%x****",adev->out_device);
-    pthread_mutex_lock(&out->dev->lock);
+    /* only starting the stream needs the hw device mutex, which comes first
+     * in lock order
+     */
     pthread_mutex_lock(&out->lock);
     if (out->standby) {
-        ret = start_output_stream(out);
-        if (ret != 0) {
-			pthread_mutex_unlock(&adev->lock);
-            goto exit;
+        pthread_mutex_unlock(&out->lock);
+        pthread_mutex_lock(&adev->lock);
+        pthread_mutex_lock(&out->lock);
+        if (out->standby) {
+            ret = start_output_stream(out);
+            if (ret != 0) {
+                pthread_mutex_unlock(&adev->lock);
+                goto exit;
+            }
+            out->standby = false;
         }
-        out->standby = false;
+        pthread_mutex_unlock(&adev->lock);
     }
 #if 0
 FILE * fp=fopen("/data/audio_in","a+"); 
@@ -502,20 +608,51 @@ FILE * fp=fopen("/data/audio_in","a+");
 		LOGFUNC("could not open file: audio_in");
 }	
 #endif
-		/* only use resampler if required */
-		if (out->out_config.rate != DEFAULT_OUT_SAMPLING_RATE) {
-			out_frames = resample_process(&out->resampler, in_frames,
-							(short *)buffer, (short *)out->buffer);
+	/* writes of any size go out in chunks that fit the preallocated buffer */
+	while (in_frames > 0) {
+		unsigned int frames = in_frames;
+
+		/* only use resampler if required, it also does the channel mapping */
+		if (out->resampling) {
+			float left, right;
+			size_t ramp;
+
+			/* and applies the volume in the same pass */
+			ramp = audio_volume_get(&out->volume, &left, &right);
+			if (frames > ramp)
+				frames = ramp;
+			if (left != out->mix_gain[0] || right != out->mix_gain[1])
+				out_set_mix(out, left, right);
+			out_frames = resample_process_bounded(&out->resampler, &frames,
+							(short *)src, (short *)out->buffer, out->buffer_frames);
+			audio_volume_advance(&out->volume, frames);
+			buf = out->buffer;
+		} else if (!audio_volume_is_unity(&out->volume)) {
+			if (frames > out->buffer_frames)
+				frames = out->buffer_frames;
+			audio_volume_apply(&out->volume, src, (short *)out->buffer, frames, 2);
+			out_frames = frames;
 			buf = out->buffer;
 		} else {
-			out_frames = in_frames;
-			buf = (void *)buffer;
+			out_frames = frames;
+			buf = (void *)src;
 		}
-	
-    pcm_write(out->out_pcm, (void *)buf, out_frames * out->out_config.channels * 2);
+		if (frames == 0)
+			break;
+
+		pcm_write(out->out_pcm, (void *)buf, out_frames * out->out_config.channels * 2);
+		src += frames * 2;
+		in_frames -= frames;
+	}
+	{
+		struct timespec ts;
+		uint64_t held;
+
+		if (out_get_held_frames(out, &held, &ts) == 0)
+			audio_render_clock_update(&out->render_clock, bytes / frame_size, held, &ts);
+	}
 
     pthread_mutex_unlock(&out->lock);
-    pthread_mutex_unlock(&out->dev->lock);
 
     return bytes;
 
@@ -550,7 +687,13 @@ static int out_remove_audio_effect(const struct audio_stream *stream, effect_han
 static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
                                         int64_t *timestamp)
 {
-    return -EINVAL;
+    struct aml_stream_out *out = (struct aml_stream_out *)stream;
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = audio_render_clock_next(&out->render_clock, timestamp);
+    pthread_mutex_unlock(&out->lock);
+    return ret;
 }
 
 
@@ -684,44 +827,20 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
 
 static int get_usb_card(struct aml_audio_device *dev)
 {
-    int card = -1,err=0;
-    int fd;
     struct aml_audio_device *adev = dev;
-    uint i=0,usbid;
-    int string_length=32,str_len=8;
-    char *read_buf, *str;
-    int card_num;
-    char *str_start;
-    fd = open(USB_AUDIO_PCM, O_RDONLY);
-    
-    if (fd <0) {
-        ALOGE("ERROR: failed to open config file %s error: %d\n", USB_AUDIO_PCM, errno);
-        close(fd);
-        return -EINVAL;
+    int card;
+
+    /* stream open and routing are where USB cards come and go, rescan */
+    audio_topology_refresh();
+    card = audio_topology_find_card("USB-Audio");
+    if (card < 0) {
+        ALOGE("ERROR: no USB-Audio card listed in /proc/asound/cards");
+        return card;
     }
-  
-    read_buf = (char *)malloc(string_length);
-    str = (char*)malloc(str_len);
-    memset(read_buf, 0x0, string_length);
-    memset(read_buf, 0x0, str_len);
-    err = read(fd, read_buf, string_length);
-    memcpy(str,read_buf,8);
-   // ALOGD("****str=%s****",str);
-        
-    usbid = strtoul(str, NULL, 16);
-    card = atoi(read_buf + 9);
     adev->card = card;
     ALOGD("******get_usb_card***card=%d***",adev->card);
-	adev->card_device= 0;
-    
-    free(read_buf);
-    free(str);
-    read_buf = NULL;
-    str = NULL;
-    close(fd);
-    return err;
-
-
+    adev->card_device= 0;
+    return 0;
 }
 #if 0
 static int get_usb_card(struct aml_stream_in *in){
@@ -756,6 +875,15 @@ static int get_usb_card(struct aml_stream_in *in){
 	return err;
 }
 #endif
+/* capture conversion shares the playback quality setting */
+static uint32_t in_resampler_quality(void)
+{
+    char quality[PROPERTY_VALUE_MAX];
+
+    property_get(RESAMPLER_QUALITY_PROPERTY, quality, "linear");
+    return resampler_quality_from_string(quality);
+}
+
 static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                                    struct resampler_buffer* buffer)
 {
@@ -833,10 +961,10 @@ static int start_input_stream(struct aml_stream_in *in)
         in->buf_provider.get_next_buffer = get_next_buffer;
         in->buf_provider.release_buffer = release_buffer;
 		ALOGD("Create resampler for input stream");
-        err = create_resampler(in->in_config.rate,
+        err = create_aml_resampler(in->in_config.rate,
                                in->requested_rate,
                                in->in_config.channels,
-                               RESAMPLER_QUALITY_DEFAULT,
+                               in_resampler_quality(),
                                &in->buf_provider,
                                &in->resampler);
         if (err != 0) {
@@ -858,7 +986,7 @@ static int start_input_stream(struct aml_stream_in *in)
 	
 err:
 		if (in->resampler)
-			release_resampler(in->resampler);
+			release_aml_resampler(in->resampler);
 	return err;
 }
 /* read_frames() reads frames from kernel driver, down samples to capture rate
@@ -909,18 +1037,21 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
 		size_t frames_rq = bytes / audio_stream_frame_size(&stream->common);
     //LOGFUNC("%s(in->num_preprocessors=%d, frames_rq=%d)", __FUNCTION__, in->num_preprocessors, frames_rq);
 
-		/* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-		 * on the input stream mutex - e.g. executing select_mode() while holding the hw device
-		 * mutex
+		/* only starting the stream needs the hw device mutex, which comes first
+		 * in lock order
 		 */
-		pthread_mutex_lock(&adev->lock);
 		pthread_mutex_lock(&in->lock);
 		if (in->standby) {
-			ret = start_input_stream(in);
-			if (ret == 0)
-				in->standby = 0;
+			pthread_mutex_unlock(&in->lock);
+			pthread_mutex_lock(&adev->lock);
+			pthread_mutex_lock(&in->lock);
+			if (in->standby) {
+				ret = start_input_stream(in);
+				if (ret == 0)
+					in->standby = 0;
+			}
+			pthread_mutex_unlock(&adev->lock);
 		}
-		pthread_mutex_unlock(&adev->lock);
 
 	
 #if 0
@@ -1023,6 +1154,8 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
     out->out_config = pcm_out_config;
+    audio_volume_init(&out->volume, out_get_sample_rate(&out->stream.common));
+    audio_render_clock_reset(&out->render_clock, out_get_sample_rate(&out->stream.common));
 
     out->dev = adev;
     ret = get_usb_card(adev);
@@ -1204,10 +1337,10 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
         in->buf_provider.get_next_buffer = get_next_buffer;
         in->buf_provider.release_buffer = release_buffer;
 		ALOGD("Create resampler for input stream");
-        ret = create_resampler(in->in_config.rate,
+        ret = create_aml_resampler(in->in_config.rate,
                                in->requested_rate,
                                in->in_config.channels,
-                               RESAMPLER_QUALITY_DEFAULT,
+                               in_resampler_quality(),
                                &in->buf_provider,
                                &in->resampler);
         if (ret != 0) {
@@ -1226,7 +1359,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 
 err_open:
     if (in->resampler)
-        release_resampler(in->resampler);
+        release_aml_resampler(in->resampler);
     mixer_close(usb_mixer);
     free(in);
     *stream_in = NULL;
@@ -1240,6 +1373,9 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
     ALOGD("******%s******", __func__);//
 
     in_standby(&stream->common);
+    if (in->resampler)
+        release_aml_resampler(in->resampler);
+    free(in->buffer);
     free(stream);
 }
 